@@ -4,7 +4,7 @@ int kernel[3][3] = { { 4, 8, 4},
 
 int radius = 1;
 
-void blur_pixels(char pixels[], vec2 min_coords, vec2 max_coords, int x, int y)
+KERNEL_INLINE void blur_pixels(char pixels[], vec2 min_coords, vec2 max_coords, int x, int y)
 {
     for (int j = min_coords.y; j <=max_coords.y; j++)
     {
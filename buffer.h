@@ -0,0 +1,59 @@
+// Shadow buffer allocation
+// The shadow buffer is written all over every frame, at 4K that's
+// 33 MB, so backing it with 2 MB pages saves thousands of TLB misses.
+// Explicit huge pages (hugetlbfs, vm.nr_hugepages) are tried first,
+// then transparent huge pages, then regular pages
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+const char *shadow_buffer_kind = "none";
+
+size_t shadow_buffer_mapping_size(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// Zeroed like calloc(). Free with free_shadow_buffer()
+char *alloc_shadow_buffer(size_t size)
+{
+    size_t mapping_size = shadow_buffer_mapping_size(size);
+    char *buffer = MAP_FAILED;
+
+    if (HUGE_PAGES) {
+#ifdef MAP_HUGETLB
+        buffer = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED) {
+            shadow_buffer_kind = "explicit huge pages";
+            return buffer;
+        }
+#endif
+    }
+
+    // mmap only aligns to regular pages. Transparent huge pages need 2 MB
+    // aligned ranges, so map a huge page more and trim both ends
+    size_t padding = HUGE_PAGES ? HUGE_PAGE_SIZE : 0;
+    buffer = mmap(NULL, mapping_size + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return NULL;
+    if (padding) {
+        size_t head = (HUGE_PAGE_SIZE - (uintptr_t)buffer % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        if (head)
+            munmap(buffer, head);
+        if (padding - head)
+            munmap(buffer + head + mapping_size, padding - head);
+        buffer += head;
+    }
+    shadow_buffer_kind = "regular pages";
+#ifdef MADV_HUGEPAGE
+    if (HUGE_PAGES && madvise(buffer, mapping_size, MADV_HUGEPAGE) == 0)
+        shadow_buffer_kind = "transparent huge pages";
+#endif
+    return buffer;
+}
+
+void free_shadow_buffer(char *buffer, size_t size)
+{
+    if (buffer)
+        munmap(buffer, shadow_buffer_mapping_size(size));
+}
@@ -113,108 +113,119 @@ camera setup_camera(camera camera)
 }
 
 
-// Gets a pixel from the end of a ray projected to an axis
-vec4 get_pixel_from_projection(
-    float t, int face, camera camera, vec3 focal_vector, light3 light,
-    float cube_rotation_y, vec3 local_focal_point, vec3 local_focal_vector
+// Everything the per-pixel code needs that stays constant for a frame.
+// Built once with setup_uniforms() and passed around by const pointer
+typedef struct uniforms
+{
+    camera camera; // The set up camera this block was built from
+    float time;
+
+    // Cube placement. The cube is drawn around the origin of its
+    // own (local) space, these move points between both spaces
+    mat4 cube_to_world;
+    mat4 world_to_cube;
+
+    // Camera in cube space. A pixel's ray direction is
+    // local_ray_origin + local_base_x * x + local_base_y * y
+    // with x and y already offset by camera.center_offset
+    vec3 local_focal_point;
+    vec3 local_ray_origin;
+    vec3 local_base_x;
+    vec3 local_base_y;
+
+    lighting_cache lighting;
+
+    const span_shader *shader;
+    shader_uniforms shader_uniforms;
+#if FIXED_POINT
+    fixed_uniforms fixed;
+#endif
+} uniforms;
+
+
+// camera has to be set up with setup_camera() first
+uniforms setup_uniforms(camera camera, const light3 lights[], int light_count, mat4 cube_to_world,
+    const span_shader *shader)
+{
+    uniforms u;
+    u.camera = camera;
+    u.time = camera.time;
+    u.shader = shader;
+    u.shader_uniforms = (shader_uniforms){camera.time, {SIDE_LENGTH, SIDE_LENGTH}};
+    u.cube_to_world = cube_to_world;
+    u.world_to_cube = inverse_affine_mat4(cube_to_world);
+
+    u.local_focal_point = transform_point_mat4(u.world_to_cube, camera.focal_point);
+    u.local_ray_origin = transform_direction_mat4(u.world_to_cube,
+        subtract_vec3(camera.center_point, camera.focal_point));
+    u.local_base_x = transform_direction_mat4(u.world_to_cube, camera.base_x);
+    u.local_base_y = transform_direction_mat4(u.world_to_cube, camera.base_y);
+
+    u.lighting = setup_lighting(lights, light_count, camera.focal_point, u.world_to_cube, cube_to_world);
+#if FIXED_POINT
+    u.fixed = setup_fixed_uniforms(camera.center_offset, u.local_focal_point, u.local_ray_origin,
+        u.local_base_x, u.local_base_y, &u.lighting);
+#endif
+    return u;
+}
+
+
+// Finds where a ray ends on a face plane. Returns 0 if it misses the
+// face, 1 if it lands on the edge band and 2 if it lands inside it
+KERNEL_INLINE int face_hit(
+    float t, int face, const uniforms *u, vec3 local_focal_vector,
+    vec3 *intersection, vec2 *face_coords
 ) {
-    if (t < 1) {
-        return (vec4){0, 0, 0, 0};
+    // Rays lying in the face plane give 0/0 or infinity, those miss too
+    if (!isfinite(t) || t < 1) {
+        return 0;
     }
 
     // Intersection in local (cube) space
     vec3 intersection_local = add_vec3(
-        scale_vec3(local_focal_vector, t), local_focal_point
+        scale_vec3(local_focal_vector, t), u->local_focal_point
     );
 
-    // Save necessary coordinates and normal vector
+    // Save necessary coordinates
     vec2 cam_coords;
-    vec3 normal_local;
     switch (face) {
         case 0:
             cam_coords = (vec2){intersection_local.x, intersection_local.y};
-            normal_local = (vec3){0, 0, 1};
             break;
         case 1:
             cam_coords = (vec2){intersection_local.x, intersection_local.y};
-            normal_local = (vec3){0, 0, -1};
             break;
         case 2:
             cam_coords = (vec2){intersection_local.z, intersection_local.y};
-            normal_local = (vec3){1, 0, 0};
             break;
         case 3:
             cam_coords = (vec2){intersection_local.z, intersection_local.y};
-            normal_local = (vec3){-1, 0, 0};
             break;
         case 4:
             cam_coords = (vec2){intersection_local.z, intersection_local.x};
-            normal_local = (vec3){0, 1, 0};
             break;
         case 5:
             cam_coords = (vec2){intersection_local.z, intersection_local.x};
-            normal_local = (vec3){0, -1, 0};
             break;
     }
     cam_coords.x += SIDE_LENGTH / 2;
     cam_coords.y += SIDE_LENGTH / 2;
 
-    vec4 pixel;
+    *intersection = intersection_local;
+    *face_coords = cam_coords;
     if (cam_coords.x > SIDE_LENGTH - 1 ||
         cam_coords.y > SIDE_LENGTH - 1 ||
         cam_coords.x < 0 || cam_coords.y < 0) {
-        return (vec4){0, 0, 0, 0};
+        return 0;
     } else if (cam_coords.x > SIDE_LENGTH - EDGE_THICKNESS - 1 ||
                cam_coords.y > SIDE_LENGTH - EDGE_THICKNESS - 1 ||
         cam_coords.x < EDGE_THICKNESS || cam_coords.y < EDGE_THICKNESS) {
-        pixel = EDGE_COLOR;
-    } else {
-        pixel = SHADER(cam_coords, face);
-    }
-
-    vec3 intersection = rotate_vec3_y(intersection_local, cube_rotation_y);
-    vec3 normal = rotate_vec3_y(normal_local, cube_rotation_y);
-
-    // Lighting calculation in world space:
-    if (SHADING) {
-        // Use light.position as-is (world space)
-        double base_light = 0.2;
-        vec3 incident = normalize_vec3(subtract_vec3(light.position, intersection));
-        double dot = dot_product_vec3(incident, normal);
-        vec3 diffuse = scale_vec3(light.color, (fmin(dot, 0) - base_light) / (-1 - base_light));
-        pixel.x *= diffuse.x;
-        pixel.y *= diffuse.y;
-        pixel.z *= diffuse.z;
-
-        // Specular highlight
-        if (SPECULAR_HIGHLIGHT) {
-    double smoothness = 0.2;
-    // View direction: from intersection to camera
-    vec3 view_dir = normalize_vec3(subtract_vec3(camera.focal_point, intersection));
-    // Light direction: from surface to light
-    vec3 light_dir = normalize_vec3(subtract_vec3(light.position, intersection));
-    // Reflection direction: reflect(-light_dir, normal)
-    double ndotl = dot_product_vec3(normal, light_dir);
-    vec3 reflected = subtract_vec3(
-        scale_vec3(normal, 2 * ndotl),
-        light_dir
-    );
-    reflected = normalize_vec3(reflected);
-    // Specular intensity
-    double spec = pow(fmax(0, dot_product_vec3(view_dir, reflected)), smoothness * 100);
-    vec3 highlight = scale_vec3(light.color, spec);
-    pixel.x += highlight.x;
-    pixel.y += highlight.y;
-    pixel.z += highlight.z;
-}
-
-        pixel.w = 1;
+        return 1;
     }
-
-    return pixel;
+    return 2;
 }
 
-vec4 alpha_composite(vec4 color1, vec4 color2) {
+KERNEL_INLINE vec4 alpha_composite(vec4 color1, vec4 color2) {
     float ar = color1.w + color2.w - (color1.w * color2.w);
     float asr = color2.w / ar;
     float a1 = 1 - asr;
@@ -228,82 +239,131 @@ vec4 alpha_composite(vec4 color1, vec4 color2) {
     return outcolor;
 }
 
-vec4 get_pixel_through_camera(int x, int y, camera camera, light3 light) {
-    // Offset coords
-    x -= camera.center_offset.x;
-    y -= camera.center_offset.y;
-
-    // Find the pixel 3d position using the camera vector basis
-    vec3 pixel_3dposition = add_vec3(
-        camera.center_point,
-        add_vec3(
-            scale_vec3(camera.base_x, x),
-            scale_vec3(camera.base_y, y)
-        )
-    );
-
-    // Get the vector going from the focal point to the pixel in 3d space
-    vec3 focal_vector = subtract_vec3(pixel_3dposition, camera.focal_point);
-
-    // --- CUBE ROTATION ---
-    float cube_rotation_y = camera.time*4*PI/1000; // or any function of time
-
-    // Rotate the ray into the cube's local space
-    vec3 local_focal_point = rotate_vec3_y(camera.focal_point, -cube_rotation_y);
-    vec3 local_focal_vector = rotate_vec3_y(focal_vector, -cube_rotation_y);
+#define SPAN_SAMPLES 64 // Samples ray cast together, their fragments are shaded in one call
+#define SPAN_FRAGMENTS (SPAN_SAMPLES * 6)
 
+// Ray casts `count` samples, `step` pixels apart from (x, y) to the
+// right, and writes their colors. Every face a ray hits is a fragment.
+// The ones inside the edge band go through the shader together, then
+// each sample blends its fragments the way a single ray always has.
+// faces, unless NULL, gets the face each sample hits first or -1
+KERNEL_INLINE void shade_span(int x, int y, int step, int count, const uniforms *u, vec4 colors[], signed char faces[])
+{
     // Cube face planes (in local space)
     static const float a[] = {0, 0, 1, 1, 0, 0};
     static const float b[] = {0, 0, 0, 0, 1, 1};
     static const float c[] = {1, 1, 0, 0, 0, 0};
-    static const float d[] = {
-        -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1,
-        -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1,
-        -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1
-    };
-
-    vec2 t[6];
-    vec4 projection_pixels[6];
-    vec4 blended_pixels = (vec4){0, 0, 0, 0};
-    int last_valid_t = 0;
-
-    for (int i = 0; i < 6; i++) {
-        t[i].x = (d[i]
-                  - a[i] * local_focal_point.x
-                  - b[i] * local_focal_point.y
-                  - c[i] * local_focal_point.z)
-                 / (a[i] * local_focal_vector.x
-                    + b[i] * local_focal_vector.y
-                    + c[i] * local_focal_vector.z);
-        t[i].y = i;
-
-        projection_pixels[i] = get_pixel_from_projection(
-            t[i].x, round(t[i].y), camera, focal_vector, light,
-            cube_rotation_y, local_focal_point, local_focal_vector
+    const double *d = face_planes;
+    vec3 local_focal_point = u->local_focal_point;
+
+    double t[SPAN_SAMPLES][6];
+    short hits[SPAN_SAMPLES][6]; // Fragment for each face, -1 on a miss
+    vec3 intersections[SPAN_FRAGMENTS];
+    vec4 fragment_colors[SPAN_FRAGMENTS];
+    int fragment_faces[SPAN_FRAGMENTS];
+    int fragments = 0;
+
+    // What goes to the shader, and which fragment each entry came from
+    float shader_u[SPAN_FRAGMENTS], shader_v[SPAN_FRAGMENTS];
+    int32_t shader_face[SPAN_FRAGMENTS];
+    float shader_r[SPAN_FRAGMENTS], shader_g[SPAN_FRAGMENTS];
+    float shader_b[SPAN_FRAGMENTS], shader_a[SPAN_FRAGMENTS];
+    short shader_fragment[SPAN_FRAGMENTS];
+    int shaded = 0;
+
+    for (int s = 0; s < count; s++) {
+        // Offset coords
+        int px = x + s*step - u->camera.center_offset.x;
+        int py = y - u->camera.center_offset.y;
+
+        // Get the vector going from the focal point to the pixel,
+        // directly in the cube's local space
+        vec3 local_focal_vector = add_vec3(
+            u->local_ray_origin,
+            add_vec3(
+                scale_vec3(u->local_base_x, px),
+                scale_vec3(u->local_base_y, py)
+            )
         );
 
-        if (projection_pixels[i].w > 0) {
-            if (t[i].x > t[last_valid_t].x) {
-                if (!SHADING) {
-                    blended_pixels = alpha_composite(
-                        projection_pixels[i], projection_pixels[last_valid_t]
-                    );
-                } else {
-                    blended_pixels = projection_pixels[last_valid_t];
-                }
-            } else if (t[i].x < t[last_valid_t].x) {
-                if (!SHADING) {
-                    blended_pixels = alpha_composite(
-                        projection_pixels[last_valid_t], projection_pixels[i]
-                    );
-                } else {
-                    blended_pixels = projection_pixels[i];
+        for (int i = 0; i < 6; i++) {
+            t[s][i] = (d[i]
+                      - a[i] * local_focal_point.x
+                      - b[i] * local_focal_point.y
+                      - c[i] * local_focal_point.z)
+                     / (a[i] * local_focal_vector.x
+                        + b[i] * local_focal_vector.y
+                        + c[i] * local_focal_vector.z);
+
+            vec2 face_coords;
+            int hit = face_hit(t[s][i], i, u, local_focal_vector, &intersections[fragments], &face_coords);
+            hits[s][i] = hit ? fragments : -1;
+            if (hit == 0)
+                continue;
+            fragment_faces[fragments] = i;
+            if (hit == 1) {
+                fragment_colors[fragments] = EDGE_COLOR;
+            } else {
+                shader_u[shaded] = face_coords.x;
+                shader_v[shaded] = face_coords.y;
+                shader_face[shaded] = i;
+                shader_fragment[shaded] = fragments;
+                shaded++;
+            }
+            fragments++;
+        }
+    }
+
+    if (shaded > 0) {
+        fragment_span span = {shaded, shader_u, shader_v, shader_face,
+            shader_r, shader_g, shader_b, shader_a};
+        shade_fragments(u->shader, &u->shader_uniforms, &span);
+        for (int i = 0; i < shaded; i++)
+            fragment_colors[shader_fragment[i]] = (vec4){shader_r[i], shader_g[i], shader_b[i], shader_a[i]};
+    }
+
+    // Lighting is done in cube space against the per-frame cache
+    if (SHADING) {
+        for (int i = 0; i < fragments; i++)
+            fragment_colors[i] = apply_lighting(fragment_colors[i], intersections[i], fragment_faces[i], &u->lighting);
+    }
+
+    for (int s = 0; s < count; s++) {
+        vec4 projection_pixels[6];
+        vec4 blended_pixels = (vec4){0, 0, 0, 0};
+        int last_valid_t = 0;
+        int front = -1;
+
+        for (int i = 0; i < 6; i++) {
+            if (hits[s][i] >= 0 && (front < 0 || t[s][i] < t[s][front]))
+                front = i;
+            projection_pixels[i] = hits[s][i] >= 0 ? fragment_colors[hits[s][i]] : (vec4){0, 0, 0, 0};
+
+            if (projection_pixels[i].w > 0) {
+                if (t[s][i] > t[s][last_valid_t]) {
+                    if (!SHADING) {
+                        blended_pixels = alpha_composite(
+                            projection_pixels[i], projection_pixels[last_valid_t]
+                        );
+                    } else {
+                        blended_pixels = projection_pixels[last_valid_t];
+                    }
+                } else if (t[s][i] < t[s][last_valid_t]) {
+                    if (!SHADING) {
+                        blended_pixels = alpha_composite(
+                            projection_pixels[last_valid_t], projection_pixels[i]
+                        );
+                    } else {
+                        blended_pixels = projection_pixels[i];
+                    }
                 }
+                last_valid_t = i;
             }
-            last_valid_t = i;
         }
+        colors[s] = blended_pixels;
+        if (faces)
+            faces[s] = front;
     }
-    return blended_pixels;
 }
 
 vec2 project_vertex_to_screen(vec3 vertex, camera cam) {
@@ -324,12 +384,13 @@ vec2 project_vertex_to_screen(vec3 vertex, camera cam) {
     vec3 offset = subtract_vec3(intersection, cam.center_point);
 
     // Project onto camera's x and y basis
-    double x = dot_product_vec3(offset, cam.base_x);
-    double y = dot_product_vec3(offset, cam.base_y);
+    // (which aren't unit length when the camera is deformed)
+    double x = dot_product_vec3(offset, cam.base_x) / dot_product_vec3(cam.base_x, cam.base_x);
+    double y = dot_product_vec3(offset, cam.base_y) / dot_product_vec3(cam.base_y, cam.base_y);
 
-    // Convert to screen coordinates (centered)
-    x += cam.dimensions.x * 0.5;
-    y += cam.dimensions.y * 0.5;
+    // Convert to screen coordinates
+    x += cam.center_offset.x;
+    y += cam.center_offset.y;
 
     return (vec2){x, y};
 }
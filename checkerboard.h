@@ -0,0 +1,224 @@
+// Checkerboard rendering
+// With CHECKERBOARD on, only the samples of one color of a checkerboard
+// are ray cast and shaded each frame, the colors swap every frame. The
+// other half is reconstructed:
+//   - A sample that misses the cube is just background.
+//   - Otherwise its ray finds the point of the cube it sees. That point
+//     is moved to where the cube and camera were last frame and
+//     projected there, and if last frame shaded the same face at that
+//     sample, its color is taken.
+//   - Where that fails (the face changed, the point was hidden or off
+//     screen, or the color there was itself reconstructed) the shaded
+//     neighbors on the same face are averaged.
+//   - A sample without such neighbors is shaded after all.
+// Finding the point costs a ray cast but no shader or lighting, which
+// is where the time goes. The first frame, and the one after anything
+// resizes the sample grid, is shaded in full
+
+#define SAMPLE_NONE -1 // Nothing was hit
+#define SAMPLE_RECONSTRUCTED 8 // Or'ed into the face of reconstructed samples
+
+// Takes cube space points to where they were on screen last frame,
+// project_vertex_to_screen() folded together with the cube transform:
+// x = x_offset + x_scale * (x_axis . p + x_base) / (z_axis . p + z_base)
+typedef struct reprojection
+{
+    vec3 x_axis, y_axis, z_axis;
+    double x_base, y_base, z_base;
+    double x_scale, y_scale;
+    double x_offset, y_offset;
+} reprojection;
+
+reprojection setup_reprojection(const uniforms *u)
+{
+    const camera *cam = &u->camera;
+    const mat4 *m = &u->cube_to_world;
+    vec3 bases[3] = {cam->base_x, cam->base_y, cam->base_z};
+    vec3 axes[3];
+    double offsets[3];
+    // Focal point to the cube origin
+    vec3 origin = subtract_vec3((vec3){m->m[0][3], m->m[1][3], m->m[2][3]}, cam->focal_point);
+    for (int i = 0; i < 3; i++) {
+        vec3 b = bases[i];
+        axes[i] = (vec3){
+            m->m[0][0] * b.x + m->m[1][0] * b.y + m->m[2][0] * b.z,
+            m->m[0][1] * b.x + m->m[1][1] * b.y + m->m[2][1] * b.z,
+            m->m[0][2] * b.x + m->m[1][2] * b.y + m->m[2][2] * b.z};
+        offsets[i] = dot_product_vec3(origin, b);
+    }
+
+    reprojection r;
+    r.x_axis = axes[0];
+    r.y_axis = axes[1];
+    r.z_axis = axes[2];
+    r.x_base = offsets[0];
+    r.y_base = offsets[1];
+    r.z_base = offsets[2];
+    double x_length = dot_product_vec3(cam->base_x, cam->base_x);
+    double y_length = dot_product_vec3(cam->base_y, cam->base_y);
+    vec3 focal_to_center = subtract_vec3(cam->focal_point, cam->center_point);
+    r.x_scale = -cam->focal_offset / x_length;
+    r.y_scale = -cam->focal_offset / y_length;
+    r.x_offset = dot_product_vec3(focal_to_center, cam->base_x) / x_length + cam->center_offset.x;
+    r.y_offset = dot_product_vec3(focal_to_center, cam->base_y) / y_length + cam->center_offset.y;
+    return r;
+}
+
+typedef struct sample_history
+{
+    int columns, rows; // One sample per downscaled block
+    int downscaling_factor;
+
+    // The samples of the frame being drawn and of the last one, swapped
+    // every frame: packed colors and the face each one shows
+    uint32_t *colors[2];
+    signed char *faces[2];
+    int current;
+
+    unsigned long frame;
+    int valid; // Whether the last frame can be reprojected from
+    reprojection previous;
+} sample_history;
+
+void free_sample_history(sample_history *history)
+{
+    for (int i = 0; i < 2; i++) {
+        free(history->colors[i]);
+        free(history->faces[i]);
+        history->colors[i] = NULL;
+        history->faces[i] = NULL;
+    }
+    history->columns = history->rows = 0;
+    history->valid = 0;
+}
+
+// Sizes the history for a frame, dropping it if the grid changed.
+// Returns 0 if it couldn't be allocated
+int prepare_sample_history(sample_history *history, int width, int height, int downscaling_factor)
+{
+    int columns = (width + downscaling_factor - 1) / downscaling_factor;
+    int rows = (height + downscaling_factor - 1) / downscaling_factor;
+    if (history->colors[0] && columns == history->columns && rows == history->rows &&
+        downscaling_factor == history->downscaling_factor)
+        return 1;
+
+    free_sample_history(history);
+    for (int i = 0; i < 2; i++) {
+        history->colors[i] = malloc((size_t)columns * rows * sizeof(uint32_t));
+        history->faces[i] = malloc((size_t)columns * rows);
+        if (history->colors[i] == NULL || history->faces[i] == NULL) {
+            free_sample_history(history);
+            return 0;
+        }
+    }
+    history->columns = columns;
+    history->rows = rows;
+    history->downscaling_factor = downscaling_factor;
+    return 1;
+}
+
+// Face the ray through pixel (x, y) sees first, or SAMPLE_NONE, and
+// where it hits it in cube space. Same intersections as shade_span().
+// hint is a face to try first, usually what a neighbor sees: the cube
+// is convex, so if the ray hits a face that is the front face for
+// another ray, it's the front face for this one too
+KERNEL_INLINE int front_face(int x, int y, const uniforms *u, int hint, vec3 *local_point)
+{
+    static const float a[] = {0, 0, 1, 1, 0, 0};
+    static const float b[] = {0, 0, 0, 0, 1, 1};
+    static const float c[] = {1, 1, 0, 0, 0, 0};
+    const double *d = face_planes;
+    vec3 local_focal_point = u->local_focal_point;
+
+    int px = x - u->camera.center_offset.x;
+    int py = y - u->camera.center_offset.y;
+    vec3 local_focal_vector = add_vec3(
+        u->local_ray_origin,
+        add_vec3(
+            scale_vec3(u->local_base_x, px),
+            scale_vec3(u->local_base_y, py)
+        )
+    );
+
+    if (hint != SAMPLE_NONE) {
+        double t = (d[hint]
+                   - a[hint] * local_focal_point.x
+                   - b[hint] * local_focal_point.y
+                   - c[hint] * local_focal_point.z)
+                  / (a[hint] * local_focal_vector.x
+                     + b[hint] * local_focal_vector.y
+                     + c[hint] * local_focal_vector.z);
+        vec2 face_coords;
+        if (face_hit(t, hint, u, local_focal_vector, local_point, &face_coords))
+            return hint;
+    }
+
+    int front = SAMPLE_NONE;
+    double front_t = 0;
+    for (int i = 0; i < 6; i++) {
+        double t = (d[i]
+                   - a[i] * local_focal_point.x
+                   - b[i] * local_focal_point.y
+                   - c[i] * local_focal_point.z)
+                  / (a[i] * local_focal_vector.x
+                     + b[i] * local_focal_vector.y
+                     + c[i] * local_focal_vector.z);
+        vec3 intersection;
+        vec2 face_coords;
+        if (face_hit(t, i, u, local_focal_vector, &intersection, &face_coords) &&
+            (front == SAMPLE_NONE || t < front_t)) {
+            front = i;
+            front_t = t;
+            *local_point = intersection;
+        }
+    }
+    return front;
+}
+
+// Color of a sample the cube point local_point on face was in last
+// frame, if that one was shaded and showed the same face
+KERNEL_INLINE int reproject_sample(const sample_history *history, vec3 local_point, int face, uint32_t *color)
+{
+    const reprojection *r = &history->previous;
+    double depth = dot_product_vec3(r->z_axis, local_point) + r->z_base;
+    if (fabs(depth) < 1e-6) depth = 1e-6;
+    double x = r->x_offset + r->x_scale * (dot_product_vec3(r->x_axis, local_point) + r->x_base) / depth;
+    double y = r->y_offset + r->y_scale * (dot_product_vec3(r->y_axis, local_point) + r->y_base) / depth;
+    int column = (int)floor(x / history->downscaling_factor + 0.5);
+    int row = (int)floor(y / history->downscaling_factor + 0.5);
+    if (column < 0 || row < 0 || column >= history->columns || row >= history->rows)
+        return 0;
+
+    size_t index = (size_t)row * history->columns + column;
+    if (history->faces[!history->current][index] != face)
+        return 0;
+    *color = history->colors[!history->current][index];
+    return 1;
+}
+
+// Averages the neighbors of a sample that were shaded this frame on
+// the same face
+KERNEL_INLINE int interpolate_sample(const sample_history *history, int column, int row, int face, uint32_t *color)
+{
+    static const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    const uint32_t *colors = history->colors[history->current];
+    const signed char *faces = history->faces[history->current];
+    uint32_t sum[3] = {0, 0, 0};
+    int count = 0;
+    for (int n = 0; n < 4; n++) {
+        int x = column + offsets[n][0];
+        int y = row + offsets[n][1];
+        if (x < 0 || y < 0 || x >= history->columns || y >= history->rows)
+            continue;
+        size_t index = (size_t)y * history->columns + x;
+        if (faces[index] != face)
+            continue;
+        for (int channel = 0; channel < 3; channel++)
+            sum[channel] += (colors[index] >> (8 * channel)) & 0xFF;
+        count++;
+    }
+    if (count == 0)
+        return 0;
+    *color = sum[0] / count | (sum[1] / count) << 8 | (sum[2] / count) << 16 | 87u << 24;
+    return 1;
+}
@@ -1,16 +1,35 @@
 #define FB_DEVICE "/dev/fb0"
+#define FB_OUTPUTS { {FB_DEVICE, 0, 0} } // Screens to draw on, as {device, x, y}. x and y place each view on a shared plane, e.g. two panels side by side: { {"/dev/fb0", 0, 0}, {"/dev/fb1", 1920, 0} }
 #define INPUT_DEVICE "/dev/input/event3"
+#define TERMINAL_OUTPUT 0 // Draw in the current terminal with truecolor escape codes instead of FB_DEVICE
+#define TERMINAL_SCALE 1080 // Screen height (in pixels) the terminal view is scaled to look like
+#define RECORD 0 // Record every presented frame to RECORD_FILE. Play it back with tty_cube_player
+#define RECORD_FILE "recording.ttyc"
+#define EXPORT_FRAMES 0 // Publish every presented frame in shared memory for other processes to read. See export.h
+#define EXPORT_NAME "/tty_cube" // Shows up as /dev/shm/tty_cube
+#define EXPORT_SLOTS 4 // Frames kept in the ring, readers lagging more than this skip frames
 #define RENDER_OVER_TEXT 0
 #define RENDER_BOUNDING_BOX 1
 #define FRAME_LIMIT 60 // 0 to deactivate
+#define IDLE_TIMEOUT 0 // Seconds without input before the cube stops and the loop sleeps until a key is pressed | 0 to always render
+#define ATTRACT_FPS 0 // Keep the cube turning at this frame rate while idle instead of stopping | 0 to stop
 #define SHADING 1
 #define SPECULAR_HIGHLIGHT 1 // SHADING has to be on for this to work
+#define LIGHTS { {LIGHT_POINT, {SIDE_LENGTH*4,-SIDE_LENGTH*5,-SIDE_LENGTH*2}, {1,1,1}, 1, 0} } // Up to 16 lights, as {type, position, color, intensity, range}. See below
 #define SPEED 1
 #define SIDE_LENGTH 800
 #define EDGE_THICKNESS 50
 #define EDGE_COLOR (vec4){1,1,1,1}
-#define SHADER checker_pattern
+#define SHADER checker_pattern // Default shader, --shader picks another one or loads a plugin
+#define SHADER_HOT_RELOAD 1 // Reload shader plugins when their file changes
 #define DOWNSCALING_FACTOR 4 // Preferably a number that divides your screen dimensions | 1 for no Down
+#define CHECKERBOARD 0 // Shade half the samples each frame and reproject the rest from the last one. See checkerboard.h
+#define FIXED_POINT 0 // Integer math per pixel, for CPUs with a slow or no FPU. See fixed.h
+#define HUGE_PAGES 1 // Back the draw buffer with huge pages when the system has them
+#define STREAMING_PRESENT 1 // Copy frames to the framebuffer with cache bypassing stores
+#define PIPELINED_PRESENT 1 // Present each frame on a thread of its own while the next one is drawn. Takes a second draw buffer per screen
+#define PERF_COUNTERS 0 // Count cycles, cache misses and such per render stage with perf_event_open. See perf.h
+#define PERF_REPORT_INTERVAL 5 // Seconds between counter reports | 0 for only at exit
 #define BLUR_ANTIALIAS 0 // Kinda antialias the fargment shader with some gaussian blue
 
 // Supported shaders:
@@ -18,6 +37,7 @@
 // gradient
 // checker_pattern
 // image
+// video
 // ------------------
 // Check fragment_shaders.h for more info
 
@@ -26,3 +46,19 @@
 // 2. Run `./setup_image.sh <path_to_image>`
 // 3. Uncomment the line below
 // #define IMAGE "image.dat"
+
+// Lights in LIGHTS can be:
+// {LIGHT_POINT, position, color, intensity, range}: shines from position,
+//   fading out over range (0 to light everything however far)
+// {LIGHT_DIRECTIONAL, direction, color, intensity, 0}: like the sun,
+//   shines along direction from far away
+// Each face only shades against the lights in front of it and in range,
+// so lights only cost anything on the faces they reach. Scenarios with
+// a light_position track move the first light
+
+// To play videos on the faces of the cube:
+// 1. Set SHADER to video
+// 2. Run `./setup_video.sh <path_to_clip> <face>.ttcv` for each face
+// 3. Uncomment the line below, with NULL for faces without a clip
+// #define VIDEO_FACES {"front.ttcv", "back.ttcv", NULL, NULL, NULL, NULL}
+#define VIDEO_PREFETCH 4 // Frames decoded ahead per face
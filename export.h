@@ -0,0 +1,207 @@
+// Frame export over POSIX shared memory
+// With EXPORT_FRAMES on, every presented frame of the first output is
+// published into a ring of EXPORT_SLOTS slots in the shared memory
+// object EXPORT_NAME (/dev/shm/tty_cube). Other processes map it
+// read-only and look at frames in place, nothing is ever copied for
+// them and nothing they do can block the renderer.
+//
+// Layout: export_header, then slot_count slots of slot_size bytes each.
+// A slot is an export_slot_header followed by height rows of stride
+// bytes. Frame n (counting from 1) goes to slot n % slot_count.
+//
+// Every slot is a sequence lock. Its sequence is 2n-1 while frame n is
+// being written and 2n once it's complete. Readers:
+//   1. load header->latest (acquire), the newest complete frame n
+//   2. load the slot's sequence (acquire), it has to be 2n
+//   3. use the pixels in place
+//   4. acquire fence, load the sequence again: if it changed the writer
+//      lapped the reader and what it read is torn, drop it
+// export_latest_frame() and export_frame_valid() do these steps. A
+// reader that keeps up sees every frame, a slow one just skips some.
+// The dirty rect of frame n is what changed since frame n-1
+
+#define EXPORT_MAGIC "TTYCEXP1"
+#define EXPORT_VERSION 1
+#define EXPORT_FORMAT_BGRA32 1 // Same as RECORD_FORMAT_BGRA32
+#define EXPORT_MAX_SLOTS 64
+
+typedef struct export_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint32_t max_width; // Largest frame a slot holds
+    uint32_t max_height;
+    uint64_t latest; // Newest complete frame, 0 before the first one
+} export_header;
+
+typedef struct export_slot_header
+{
+    uint64_t sequence;
+    uint64_t frame;
+    uint64_t timestamp_us; // CLOCK_MONOTONIC
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; // Bytes between rows
+    uint32_t format;
+    uint32_t dirty_x, dirty_y, dirty_width, dirty_height;
+} export_slot_header;
+
+// Slot headers take a cache line so the pixels after them are aligned
+#define EXPORT_SLOT_HEADER_SIZE 64
+
+export_slot_header *export_slot(export_header *header, uint32_t slot)
+{
+    return (export_slot_header *)((char *)header + sizeof(export_header) + header->slot_size * slot);
+}
+
+char *export_slot_pixels(export_slot_header *slot)
+{
+    return (char *)slot + EXPORT_SLOT_HEADER_SIZE;
+}
+
+// Newest complete frame, or NULL if there is none yet. *sequence is
+// what to pass to export_frame_valid() once done with it
+export_slot_header *export_latest_frame(export_header *header, uint64_t *sequence)
+{
+    uint64_t frame = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+    if (frame == 0)
+        return NULL;
+    export_slot_header *slot = export_slot(header, frame % header->slot_count);
+    *sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    // Already being overwritten by a newer frame
+    if (*sequence != frame * 2)
+        return NULL;
+    return slot;
+}
+
+// Whether a frame read in place was left alone by the writer meanwhile
+int export_frame_valid(export_slot_header *slot, uint64_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+
+typedef struct frame_exporter
+{
+    const char *name;
+    export_header *header;
+    size_t size;
+    uint64_t frame;
+    int warned;
+
+    // Drawn area of the last frames, slot n has to catch up on all of
+    // them since it last held frame n - slot_count
+    record_rect drawn[EXPORT_MAX_SLOTS + 1];
+} frame_exporter;
+
+int setup_exporter(frame_exporter *exp, const char *name, int slots, int max_width, int max_height)
+{
+    memset(exp, 0, sizeof(frame_exporter));
+    exp->name = name;
+    if (slots < 2 || slots > EXPORT_MAX_SLOTS) {
+        fprintf(stderr, "EXPORT_SLOTS has to be between 2 and %d\n", EXPORT_MAX_SLOTS);
+        return 0;
+    }
+
+    size_t slot_size = EXPORT_SLOT_HEADER_SIZE + (size_t)max_width * max_height * 4;
+    slot_size = (slot_size + 4095) / 4096 * 4096;
+    exp->size = sizeof(export_header) + slot_size * slots;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating shared memory '%s': %s\n", name, strerror(errno));
+        return 0;
+    }
+    if (ftruncate(fd, exp->size)) {
+        fprintf(stderr, "Error sizing shared memory '%s': %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+    exp->header = mmap(NULL, exp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (exp->header == MAP_FAILED) {
+        exp->header = NULL;
+        fprintf(stderr, "Error mapping shared memory '%s': %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return 0;
+    }
+
+    exp->header->version = EXPORT_VERSION;
+    exp->header->slot_count = slots;
+    exp->header->slot_size = slot_size;
+    exp->header->max_width = max_width;
+    exp->header->max_height = max_height;
+    // Readers check the magic last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(exp->header->magic, EXPORT_MAGIC, 8);
+    return 1;
+}
+
+// Publishes a frame. drawn is everything painted this frame, as for
+// record_frame()
+void export_frame(frame_exporter *exp, const char buffer[], uint32_t width, uint32_t height, record_rect drawn)
+{
+    export_header *header = exp->header;
+    if (width > header->max_width || height > header->max_height) {
+        if (!exp->warned)
+            fprintf(stderr, "Frames grew past the export slots, not exporting them\n");
+        exp->warned = 1;
+        return;
+    }
+
+    uint64_t frame = ++exp->frame;
+    uint32_t slots = header->slot_count;
+    export_slot_header *slot = export_slot(header, frame % slots);
+    char *pixels = export_slot_pixels(slot);
+    record_rect *history = exp->drawn;
+    int history_size = EXPORT_MAX_SLOTS + 1;
+
+    // Catch the slot up from the frame it holds. Slots that were never
+    // written or had another size get everything
+    history[frame % history_size] = drawn;
+    record_rect copy = drawn;
+    record_rect dirty = record_rect_union(drawn, history[(frame - 1) % history_size]);
+    if (frame <= slots || slot->width != width || slot->height != height) {
+        copy = (record_rect){0, 0, width, height};
+    } else {
+        for (uint64_t i = frame - slots; i < frame; i++)
+            copy = record_rect_union(copy, history[i % history_size]);
+    }
+    if (frame == 1 || export_slot(header, (frame - 1) % slots)->width != width ||
+        export_slot(header, (frame - 1) % slots)->height != height)
+        dirty = (record_rect){0, 0, width, height};
+
+    __atomic_store_n(&slot->sequence, frame * 2 - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    slot->frame = frame;
+    slot->timestamp_us = now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+    slot->width = width;
+    slot->height = height;
+    slot->stride = width * 4;
+    slot->format = EXPORT_FORMAT_BGRA32;
+    slot->dirty_x = dirty.x;
+    slot->dirty_y = dirty.y;
+    slot->dirty_width = dirty.width;
+    slot->dirty_height = dirty.height;
+    for (int y = copy.y; y < copy.y + copy.height; y++)
+        memcpy(pixels + (size_t)y*slot->stride + copy.x*4, buffer + ((size_t)y*width + copy.x)*4, copy.width * 4);
+
+    __atomic_store_n(&slot->sequence, frame * 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, frame, __ATOMIC_RELEASE);
+}
+
+void close_exporter(frame_exporter *exp)
+{
+    if (exp->header == NULL)
+        return;
+    munmap(exp->header, exp->size);
+    shm_unlink(exp->name);
+    exp->header = NULL;
+}
@@ -0,0 +1,436 @@
+// Fixed point rendering path (FIXED_POINT in config.h)
+// For cores without a fast FPU. Per-frame setup still uses doubles, but
+// everything done per pixel (ray setup, plane intersection, face
+// coordinates, shaders, lighting and color packing) is integer math.
+//
+// Formats:
+//   fixed      Q16.16 in an int32: positions, face coordinates, colors
+//   ray param  Q8.24 in an int64: distance along the ray, t
+//   products   Q32.32 in an int64
+//   1/length   Q24.40 in an int64, from rsqrt_q40()
+// Positions resolve to 1/65536 of a pixel and t to 6e-8, so coordinates
+// on a face are within ~1e-4 px of the double path. Colors come out
+// within 1/255 per channel of the double path, except for pixels that
+// lie within that distance of a face, edge or pattern boundary.
+// Scenes are assumed to fit in +-32767 units from the cube.
+// Each ray still divides by its direction once per face, in 64 bits,
+// which is a library call on 32-bit ARM. Speed was only measured on
+// x86-64 so far.
+
+#if FIXED_POINT
+
+typedef int32_t fixed;
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define RAY_SHIFT 24
+#define RAY_ONE ((int64_t)1 << RAY_SHIFT)
+
+typedef struct fixed_vec3
+{
+    fixed x, y, z;
+} fixed_vec3;
+
+typedef struct fixed_color
+{
+    fixed r, g, b, a;
+} fixed_color;
+
+// Per-frame values, converted once from the double uniforms
+typedef struct fixed_uniforms
+{
+    fixed center_offset_x;
+    fixed center_offset_y;
+    fixed_vec3 focal_point; // All in cube space
+    fixed_vec3 ray_origin;
+    fixed_vec3 base_x;
+    fixed_vec3 base_y;
+
+    fixed_vec3 view;
+    fixed view_distance[6];
+    fixed ambient;
+    fixed diffuse_scale; // 1 / (1 + AMBIENT_LIGHT)
+
+    // Lights as in lighting_cache. Directional ones keep their unit
+    // vector and the cosine per face instead of position and distance
+    fixed_vec3 light[MAX_LIGHTS];
+    fixed_color light_color[MAX_LIGHTS];
+    int64_t light_range_squared[MAX_LIGHTS]; // Q16.16, 0 if it doesn't fade
+    unsigned char light_directional[MAX_LIGHTS];
+    fixed light_distance[6][MAX_LIGHTS];
+    unsigned char face_lights[6][MAX_LIGHTS];
+    int face_light_count[6];
+    fixed_color edge_color;
+} fixed_uniforms;
+
+// face_planes from light.h, in Q16.16
+static const fixed face_planes_fixed[6] = {
+    -SIDE_LENGTH * (FIXED_ONE / 2), SIDE_LENGTH * (FIXED_ONE / 2) - FIXED_ONE,
+    -SIDE_LENGTH * (FIXED_ONE / 2), SIDE_LENGTH * (FIXED_ONE / 2) - FIXED_ONE,
+    -SIDE_LENGTH * (FIXED_ONE / 2), SIDE_LENGTH * (FIXED_ONE / 2) - FIXED_ONE
+};
+
+fixed to_fixed(double value)
+{
+    return (fixed)lround(value * FIXED_ONE);
+}
+
+fixed_vec3 to_fixed_vec3(vec3 v)
+{
+    return (fixed_vec3){to_fixed(v.x), to_fixed(v.y), to_fixed(v.z)};
+}
+
+fixed_color to_fixed_color(vec4 c)
+{
+    return (fixed_color){to_fixed(c.x), to_fixed(c.y), to_fixed(c.z), to_fixed(c.w)};
+}
+
+KERNEL_INLINE fixed fixed_multiply(fixed a, fixed b)
+{
+    return (fixed)(((int64_t)a * b) >> FIXED_SHIFT);
+}
+
+KERNEL_INLINE fixed fixed_divide(int64_t a, int64_t b)
+{
+    return b ? (fixed)((a << FIXED_SHIFT) / b) : 0;
+}
+
+// Reciprocal square roots are a table lookup refined by two Newton
+// steps, multiplies only. rsqrt_table[i] is 1/sqrt(x) in Q1.31 for x
+// at the middle of [i/16, (i+1)/16), entries 16 to 63 cover x in [1, 4)
+uint32_t rsqrt_table[64];
+
+void setup_rsqrt_table()
+{
+    for (int i = 16; i < 64; i++)
+        rsqrt_table[i] = (uint32_t)lround(2147483648.0 / sqrt((i + 0.5) / 16));
+}
+
+// 1/sqrt(n / 2^32) in Q24.40, for n a squared Q16.16 length.
+// Relative error is below 1e-8
+KERNEL_INLINE uint64_t rsqrt_q40(uint64_t n)
+{
+    if (n == 0)
+        return 0;
+
+    // n = x * 2^(e + 30) with x in [1, 4) and e even
+    int e = ((63 - __builtin_clzll(n)) - 30) & ~1;
+    uint64_t m = e >= 0 ? n >> e : n << -e;
+
+    uint64_t y = rsqrt_table[m >> 26];
+    for (int i = 0; i < 2; i++) {
+        uint64_t y2 = (y * y) >> 32;
+        uint64_t xy2 = (m * y2) >> 30;
+        y = (y * ((3ull << 30) - xy2)) >> 31;
+    }
+
+    // 1/sqrt(n / 2^32) = y / 2^31 * 2^(1 - e/2)
+    int shift = 10 - e / 2;
+    return shift >= 0 ? y << shift : y >> -shift;
+}
+
+// Same falloff as specular_table, in Q16.16
+fixed specular_table_fixed[SPECULAR_TABLE_SIZE + 2];
+
+// Needs setup_specular_table() to have run
+void setup_fixed_tables()
+{
+    for (int i = 0; i <= SPECULAR_TABLE_SIZE + 1; i++)
+        specular_table_fixed[i] = to_fixed(specular_table[i]);
+    setup_rsqrt_table();
+}
+
+KERNEL_INLINE fixed specular_lookup_fixed(fixed x)
+{
+    if (x <= 0)
+        return 0;
+    if (x >= FIXED_ONE)
+        return FIXED_ONE;
+    // SPECULAR_TABLE_SIZE is 2^10, the top bits index and the rest interpolate
+    int shift = FIXED_SHIFT - 10;
+    int index = x >> shift;
+    fixed fraction = (x & ((1 << shift) - 1)) << (FIXED_SHIFT - shift);
+    fixed low = specular_table_fixed[index];
+    return low + fixed_multiply(specular_table_fixed[index + 1] - low, fraction);
+}
+
+fixed_uniforms setup_fixed_uniforms(vec2 center_offset, vec3 focal_point, vec3 ray_origin,
+    vec3 base_x, vec3 base_y, const lighting_cache *lighting)
+{
+    fixed_uniforms f;
+    f.center_offset_x = to_fixed(center_offset.x);
+    f.center_offset_y = to_fixed(center_offset.y);
+    f.focal_point = to_fixed_vec3(focal_point);
+    f.ray_origin = to_fixed_vec3(ray_origin);
+    f.base_x = to_fixed_vec3(base_x);
+    f.base_y = to_fixed_vec3(base_y);
+    f.view = to_fixed_vec3(lighting->view_local);
+    f.ambient = to_fixed(AMBIENT_LIGHT);
+    f.diffuse_scale = to_fixed(1 / (1 + AMBIENT_LIGHT));
+    for (int l = 0; l < lighting->light_count; l++) {
+        const light_source *light = &lighting->lights[l];
+        f.light[l] = to_fixed_vec3(light->local);
+        f.light_color[l] = (fixed_color){to_fixed(light->color.x), to_fixed(light->color.y),
+            to_fixed(light->color.z), FIXED_ONE};
+        f.light_range_squared[l] = light->inverse_range_squared > 0
+            ? (int64_t)llround(FIXED_ONE / light->inverse_range_squared) : 0;
+        f.light_directional[l] = light->directional;
+    }
+    for (int i = 0; i < 6; i++) {
+        const face_lighting *face = &lighting->faces[i];
+        f.view_distance[i] = to_fixed(face->view_distance);
+        for (int l = 0; l < lighting->light_count; l++)
+            f.light_distance[i][l] = to_fixed(face->light_distance[l]);
+        memcpy(f.face_lights[i], face->lights, face->light_count);
+        f.face_light_count[i] = face->light_count;
+    }
+    f.edge_color = to_fixed_color(EDGE_COLOR);
+    return f;
+}
+
+
+// Fixed point versions of the shaders in fragment_shaders.h.
+// A custom SHADER needs a <name>_fixed version to build with FIXED_POINT
+#define FIXED_SHADER_CONCAT(name) name##_fixed
+#define FIXED_SHADER(name) FIXED_SHADER_CONCAT(name)
+
+KERNEL_INLINE fixed_color solid_white_fixed(fixed x, fixed y, int face)
+{
+    return (fixed_color){FIXED_ONE, FIXED_ONE, FIXED_ONE, FIXED_ONE};
+}
+
+KERNEL_INLINE fixed_color gradient_fixed(fixed x, fixed y, int face)
+{
+    return (fixed_color){x / SIDE_LENGTH, y / SIDE_LENGTH, FIXED_ONE, FIXED_ONE * 4 / 5};
+}
+
+KERNEL_INLINE fixed_color checker_pattern_fixed(fixed fx, fixed fy, int face)
+{
+    int x = fx >> FIXED_SHIFT;
+    int y = fy >> FIXED_SHIFT;
+    int n = 8;
+    int value = (((((x*n)/SIDE_LENGTH)+((y*n)/SIDE_LENGTH)%2))%2);
+    return (fixed_color){0, value * FIXED_ONE / 2, value * FIXED_ONE,
+        FIXED_ONE * 4 / 5 + value * FIXED_ONE / 8};
+}
+
+#ifdef IMAGE
+KERNEL_INLINE fixed_color image_fixed(fixed fx, fixed fy, int face)
+{
+    int x = (fx + FIXED_ONE / 2) >> FIXED_SHIFT;
+    int y = (fy + FIXED_ONE / 2) >> FIXED_SHIFT;
+    int value = (y * SIDE_LENGTH + x) * 3;
+    return (fixed_color){
+        (image_data[value] * FIXED_ONE + 127) / 255,
+        (image_data[value+1] * FIXED_ONE + 127) / 255,
+        (image_data[value+2] * FIXED_ONE + 127) / 255,
+        FIXED_ONE
+    };
+}
+#endif
+
+#ifdef VIDEO_FACES
+// Texel lookup of video_span(). Face coordinates drop 8 fraction bits
+// first so the scaling to the clip size fits in 32 bits
+KERNEL_INLINE fixed_color video_fixed(fixed fx, fixed fy, int face)
+{
+    const video_texture *texture = &video_textures[face];
+    if (texture->pixels == NULL)
+        return checker_pattern_fixed(fx, fy, face);
+    int x = ((fx >> 8) * texture->width / SIDE_LENGTH) >> 8;
+    int y = ((fy >> 8) * texture->height / SIDE_LENGTH) >> 8;
+    x = x < texture->width ? x : texture->width - 1;
+    y = y < texture->height ? y : texture->height - 1;
+    uint32_t pixel = texture->pixels[y * texture->width + x];
+    return (fixed_color){
+        (((pixel >> 16) & 0xFF) * FIXED_ONE + 127) / 255,
+        (((pixel >> 8) & 0xFF) * FIXED_ONE + 127) / 255,
+        ((pixel & 0xFF) * FIXED_ONE + 127) / 255,
+        FIXED_ONE
+    };
+}
+#endif
+
+
+KERNEL_INLINE fixed_color apply_lighting_fixed(fixed_color pixel, const int64_t intersection[3],
+    int face, const fixed_uniforms *f)
+{
+    fixed_color diffuse = {f->ambient, f->ambient, f->ambient, 0};
+    fixed_color specular = {0, 0, 0, 0};
+
+    int64_t to_view[3] = {0, 0, 0};
+    fixed ndotv = 0;
+    if (SPECULAR_HIGHLIGHT && f->face_light_count[face] > 0) {
+        int64_t view[3] = {f->view.x - intersection[0], f->view.y - intersection[1], f->view.z - intersection[2]};
+        int64_t view_inverse = rsqrt_q40(view[0]*view[0] + view[1]*view[1] + view[2]*view[2]);
+        ndotv = ((int64_t)f->view_distance[face] * view_inverse) >> 40;
+        for (int k = 0; k < 3; k++)
+            to_view[k] = (view[k] * view_inverse) >> 40;
+    }
+
+    for (int l = 0; l < f->face_light_count[face]; l++) {
+        int index = f->face_lights[face][l];
+        fixed_color color = f->light_color[index];
+        fixed ndotl = f->light_distance[face][index];
+        int64_t to_light[3] = {f->light[index].x, f->light[index].y, f->light[index].z};
+        if (!f->light_directional[index]) {
+            for (int k = 0; k < 3; k++)
+                to_light[k] -= intersection[k];
+            uint64_t length_squared = to_light[0]*to_light[0] + to_light[1]*to_light[1] + to_light[2]*to_light[2];
+            int64_t light_inverse = rsqrt_q40(length_squared);
+            // |component| <= length, so these products stay below 2^56
+            ndotl = ((int64_t)ndotl * light_inverse) >> 40;
+            for (int k = 0; k < 3; k++)
+                to_light[k] = (to_light[k] * light_inverse) >> 40;
+
+            int64_t range_squared = f->light_range_squared[index];
+            if (range_squared > 0) {
+                // Both are squared lengths, Q32.32 over Q16.16
+                if (length_squared >= (uint64_t)range_squared << FIXED_SHIFT)
+                    continue;
+                fixed fade = FIXED_ONE - (fixed)(length_squared / range_squared);
+                fixed falloff = fixed_multiply(fade, fade);
+                color.r = fixed_multiply(color.r, falloff);
+                color.g = fixed_multiply(color.g, falloff);
+                color.b = fixed_multiply(color.b, falloff);
+            }
+        }
+
+        // Culling left lights in front of the face only, ndotl is negative
+        diffuse.r -= fixed_multiply(color.r, ndotl);
+        diffuse.g -= fixed_multiply(color.g, ndotl);
+        diffuse.b -= fixed_multiply(color.b, ndotl);
+
+        if (SPECULAR_HIGHLIGHT) {
+            // Dot product of the normalized vectors
+            int64_t ldotv = 0;
+            for (int k = 0; k < 3; k++)
+                ldotv += to_light[k] * to_view[k];
+            ldotv >>= FIXED_SHIFT;
+
+            fixed spec = specular_lookup_fixed(2 * fixed_multiply(ndotl, ndotv) - ldotv);
+            specular.r += fixed_multiply(color.r, spec);
+            specular.g += fixed_multiply(color.g, spec);
+            specular.b += fixed_multiply(color.b, spec);
+        }
+    }
+
+    pixel.r = fixed_multiply(pixel.r, fixed_multiply(diffuse.r, f->diffuse_scale)) + specular.r;
+    pixel.g = fixed_multiply(pixel.g, fixed_multiply(diffuse.g, f->diffuse_scale)) + specular.g;
+    pixel.b = fixed_multiply(pixel.b, fixed_multiply(diffuse.b, f->diffuse_scale)) + specular.b;
+    pixel.a = FIXED_ONE;
+    return pixel;
+}
+
+KERNEL_INLINE fixed_color alpha_composite_fixed(fixed_color color1, fixed_color color2)
+{
+    fixed ar = color1.a + color2.a - fixed_multiply(color1.a, color2.a);
+    fixed asr = fixed_divide(color2.a, ar);
+    fixed a1 = FIXED_ONE - asr;
+    fixed a2 = fixed_multiply(asr, FIXED_ONE - color1.a);
+    fixed ab = fixed_multiply(asr, color1.a);
+    fixed_color out;
+    out.r = fixed_multiply(color1.r, a1) + fixed_multiply(color2.r, a2) + fixed_multiply(color2.r, ab);
+    out.g = fixed_multiply(color1.g, a1) + fixed_multiply(color2.g, a2) + fixed_multiply(color2.g, ab);
+    out.b = fixed_multiply(color1.b, a1) + fixed_multiply(color2.b, a2) + fixed_multiply(color2.b, ab);
+    out.a = ar;
+    return out;
+}
+
+// Mirrors shade_span() for one sample, including its face blending.
+// front, unless NULL, gets the face the ray hits first or -1
+KERNEL_INLINE fixed_color get_pixel_through_camera_fixed(int x, int y, const fixed_uniforms *f, int *front)
+{
+    // Offset coords, truncated toward zero like the int conversion in
+    // the double path. Shifts round down, so negatives get rounded up first
+    int64_t offset_x = ((int64_t)x << FIXED_SHIFT) - f->center_offset_x;
+    int64_t offset_y = ((int64_t)y << FIXED_SHIFT) - f->center_offset_y;
+    x = (offset_x + (offset_x < 0 ? FIXED_ONE - 1 : 0)) >> FIXED_SHIFT;
+    y = (offset_y + (offset_y < 0 ? FIXED_ONE - 1 : 0)) >> FIXED_SHIFT;
+
+    int64_t origin[3] = {f->focal_point.x, f->focal_point.y, f->focal_point.z};
+    int64_t direction[3] = {
+        f->ray_origin.x + (int64_t)f->base_x.x * x + (int64_t)f->base_y.x * y,
+        f->ray_origin.y + (int64_t)f->base_x.y * x + (int64_t)f->base_y.y * y,
+        f->ray_origin.z + (int64_t)f->base_x.z * x + (int64_t)f->base_y.z * y
+    };
+
+    // Axis each face is perpendicular to, and the two axes giving
+    // its coordinates, in the same order as face_normals
+    static const int axis[6] = {2, 2, 0, 0, 1, 1};
+    static const int u_axis[6] = {0, 0, 2, 2, 2, 2};
+    static const int v_axis[6] = {1, 1, 1, 1, 0, 0};
+    const fixed half_side = SIDE_LENGTH / 2 * FIXED_ONE;
+    const fixed far_limit = (SIDE_LENGTH - 1) * FIXED_ONE;
+    const fixed edge_low = EDGE_THICKNESS * FIXED_ONE;
+    const fixed edge_high = (SIDE_LENGTH - EDGE_THICKNESS - 1) * FIXED_ONE;
+
+    int64_t t[6];
+    fixed_color projection_pixels[6];
+    fixed_color blended_pixels = {0, 0, 0, 0};
+    int last_valid_t = 0;
+    int nearest = -1;
+
+    for (int i = 0; i < 6; i++) {
+        int64_t plane = face_planes_fixed[i];
+        int64_t denominator = direction[axis[i]];
+        projection_pixels[i] = (fixed_color){0, 0, 0, 0};
+        if (denominator == 0) {
+            t[i] = 0;
+            continue;
+        }
+        t[i] = ((plane - origin[axis[i]]) << RAY_SHIFT) / denominator;
+        // Past 4096 ray lengths the hit is far outside the scene,
+        // and the products below would overflow
+        if (t[i] < RAY_ONE || t[i] > RAY_ONE << 12)
+            continue;
+
+        int64_t intersection[3];
+        for (int k = 0; k < 3; k++)
+            intersection[k] = k == axis[i] ? plane : origin[k] + ((direction[k] * t[i]) >> RAY_SHIFT);
+
+        // Far hits are way past what a fixed holds, check before narrowing
+        int64_t u = intersection[u_axis[i]] + half_side;
+        int64_t v = intersection[v_axis[i]] + half_side;
+        fixed_color pixel;
+        if (u > far_limit || v > far_limit || u < 0 || v < 0)
+            continue;
+        if (nearest < 0 || t[i] < t[nearest])
+            nearest = i;
+        if (u > edge_high || v > edge_high || u < edge_low || v < edge_low) {
+            pixel = f->edge_color;
+        } else {
+            pixel = FIXED_SHADER(SHADER)((fixed)u, (fixed)v, i);
+        }
+        if (SHADING)
+            pixel = apply_lighting_fixed(pixel, intersection, i, f);
+        projection_pixels[i] = pixel;
+
+        if (pixel.a > 0) {
+            if (t[i] > t[last_valid_t]) {
+                blended_pixels = SHADING ? projection_pixels[last_valid_t]
+                    : alpha_composite_fixed(projection_pixels[i], projection_pixels[last_valid_t]);
+            } else if (t[i] < t[last_valid_t]) {
+                blended_pixels = SHADING ? projection_pixels[i]
+                    : alpha_composite_fixed(projection_pixels[last_valid_t], projection_pixels[i]);
+            }
+            last_valid_t = i;
+        }
+    }
+    if (front)
+        *front = nearest;
+    return blended_pixels;
+}
+
+// Same as pack_color() in render.h, from a fixed point color
+KERNEL_INLINE uint32_t pack_color_fixed(fixed_color color)
+{
+    fixed channels[3] = {color.b, color.g, color.r};
+    uint32_t packed = 87u << 24;
+    for (int c = 0; c < 3; c++) {
+        fixed value = channels[c] < 0 ? 0 : channels[c] > FIXED_ONE ? FIXED_ONE : channels[c];
+        packed |= (uint32_t)(((int64_t)value * 255) >> FIXED_SHIFT) << (c * 8);
+    }
+    return packed;
+}
+
+#endif
@@ -0,0 +1,159 @@
+// Headless comparison of the fixed point path against the double one
+// (FIXED_POINT in config.h). Renders a set of poses through both and
+// fails unless they agree within the tolerance below. Run with
+// `make check`
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include "config.h"
+#undef FIXED_POINT
+#define FIXED_POINT 1
+#include "vectors.h"
+#include "shader_api.h"
+#include "fragment_shaders.h"
+#include "light.h"
+#include "fixed.h"
+#include "camera.h"
+#include "blur.h"
+#include "checkerboard.h"
+#include "render.h"
+
+#define PI 3.14159265
+
+// Pixels are compared per channel, in 1/255 steps. Only pixels lying on
+// a face, edge or pattern boundary may round the other way, and the
+// fixed path may not draw where the double one sees no cube around
+#define MAX_DIFFERING 0.001 // Share of pixels that may differ at all
+#define MAX_DIFFERING_BY_MORE_THAN_ONE 0.0001 // And by more than 1/255
+
+typedef struct check_pose
+{
+    int width, height;
+    double time;
+    vec3 position;
+    vec3 rotation;
+} check_pose;
+
+// Same camera and cube as draw_output()
+uniforms setup_check_uniforms(check_pose pose, const light3 lights[], int light_count)
+{
+    camera cam = (camera){-SIDE_LENGTH,
+        pose.time,
+        (vec2){pose.width, pose.height},
+        pose.rotation,
+        pose.position,
+        (vec3){1,1,1},
+        (vec2){0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0}
+    };
+    camera transformed_cam = setup_camera(cam);
+    mat3 cube_rotation = rotation_mat3_y(transformed_cam.time*4*PI/1000);
+    mat4 cube_transform = affine_mat4(cube_rotation, (vec3){0, 0, 0});
+    return setup_uniforms(transformed_cam, lights, light_count, cube_transform, &SHADER);
+}
+
+int main()
+{
+    static const light3 lights[] = LIGHTS;
+    int light_count = sizeof(lights) / sizeof(light3);
+    setup_specular_table();
+    setup_fixed_tables();
+
+    // A turn of the cube seen from around the front, plus poses that
+    // once broke the fixed path: rays in a face plane, far plane hits
+    check_pose poses[26];
+    int pose_count = 0;
+    for (int i = 0; i < 24; i++) {
+        double angle = i * 2 * PI / 24;
+        poses[pose_count++] = (check_pose){1280, 720, i * 500.0 / 24,
+            (vec3){600 * sin(angle), -600 * cos(angle * 2), -1200 - 400 * cos(angle)},
+            (vec3){0.2 * cos(angle * 3), 0.3 * sin(angle), 0}};
+    }
+    poses[pose_count++] = (check_pose){1280, 720, 0, (vec3){0, -SIDE_LENGTH / 2, -1600}, (vec3){0, 0, 0}};
+    poses[pose_count++] = (check_pose){1920, 1080, 20, (vec3){0, -420, -1200}, (vec3){0.01, 0, 0}};
+
+    long pixels = 0, differing = 0, differing_by_more = 0, stray = 0;
+    int worst = 0;
+    for (int p = 0; p < pose_count; p++) {
+        check_pose pose = poses[p];
+        uniforms frame = setup_check_uniforms(pose, lights, light_count);
+        size_t size = (size_t)pose.width * pose.height;
+        uint32_t *expected = malloc(size * sizeof(uint32_t));
+        uint32_t *actual = malloc(size * sizeof(uint32_t));
+        signed char *faces = malloc(size);
+        if (expected == NULL || actual == NULL || faces == NULL) {
+            perror("Error allocating frames");
+            return 1;
+        }
+        for (int y = 0; y < pose.height; y++) {
+            for (int x = 0; x < pose.width; x += SPAN_SAMPLES) {
+                int count = pose.width - x < SPAN_SAMPLES ? pose.width - x : SPAN_SAMPLES;
+                vec4 shaded[SPAN_SAMPLES];
+                shade_span(x, y, 1, count, &frame, shaded, &faces[(size_t)y * pose.width + x]);
+                for (int s = 0; s < count; s++) {
+                    expected[(size_t)y * pose.width + x + s] = pack_color(shaded[s]);
+                    actual[(size_t)y * pose.width + x + s] =
+                        pack_color_fixed(get_pixel_through_camera_fixed(x + s, y, &frame.fixed, NULL));
+                }
+            }
+        }
+
+        const uint32_t background = pack_color((vec4){0, 0, 0, 0});
+        for (int y = 0; y < pose.height; y++) {
+            for (int x = 0; x < pose.width; x++) {
+                size_t index = (size_t)y * pose.width + x;
+                int difference = 0;
+                for (int c = 0; c < 32; c += 8) {
+                    int d = abs((int)((expected[index] >> c) & 0xFF) - (int)((actual[index] >> c) & 0xFF));
+                    difference = d > difference ? d : difference;
+                }
+                pixels++;
+                differing += difference > 0;
+                differing_by_more += difference > 1;
+                if (difference > worst) {
+                    worst = difference;
+                    printf("Pose %d: pixel (%d, %d) differs by %d/255\n", p, x, y, difference);
+                }
+
+                // Rounding only moves the silhouette, a hit with no cube
+                // anywhere around it is a broken ray
+                if (actual[index] == background || faces[index] != SAMPLE_NONE)
+                    continue;
+                int alone = 1;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < pose.width && ny < pose.height)
+                            alone &= faces[(size_t)ny * pose.width + nx] == SAMPLE_NONE;
+                    }
+                }
+                if (alone) {
+                    stray++;
+                    printf("Pose %d: stray hit at (%d, %d)\n", p, x, y);
+                }
+            }
+        }
+        free(expected);
+        free(actual);
+        free(faces);
+    }
+
+    double share = (double)differing / pixels;
+    double share_by_more = (double)differing_by_more / pixels;
+    printf("%d poses, %ld pixels: %.4f%% differ, %.4f%% by more than 1/255 (allowed %.4f%% and %.4f%%)\n",
+        pose_count, pixels, share * 100, share_by_more * 100,
+        MAX_DIFFERING * 100, MAX_DIFFERING_BY_MORE_THAN_ONE * 100);
+    if (share > MAX_DIFFERING || share_by_more > MAX_DIFFERING_BY_MORE_THAN_ONE || stray > 0) {
+        printf("FAIL: the fixed point path is off\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
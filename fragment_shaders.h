@@ -4,42 +4,138 @@
 unsigned char image_data[SIDE_LENGTH*SIDE_LENGTH*3];
 #endif
 
+#ifdef VIDEO_FACES
+// Frame each face shows, BGRA. Set between frames by video.h
+typedef struct video_texture
+{
+    const uint32_t *pixels; // NULL for faces without a clip
+    int width, height;
+} video_texture;
+video_texture video_textures[6];
+#endif
+
 // Shaders that can apply to every face of the cube
-// Your resolution is SIDE_LENGTH by SIDE_LENGTH
+// They take whole spans of fragments, see shader_api.h. These are
+// built in, pick one with SHADER in config.h or with --shader <name>.
+// Shaders can also be loaded from shared objects with --shader <path>
+// Faces are SIDE_LENGTH by SIDE_LENGTH (uniforms->resolution)
 // in case you wanna code new ones
-vec4 solid_white(vec2 fragcoord, int face)
+KERNEL_INLINE void solid_white_span(const shader_uniforms *uniforms, const fragment_span *span)
 {
-    vec4 pixel = (vec4){1, 1, 1, 1};
-    return pixel;
+    for (int i = 0; i < span->count; i++) {
+        span->r[i] = 1;
+        span->g[i] = 1;
+        span->b[i] = 1;
+        span->a[i] = 1;
+    }
 }
 
-
-vec4 gradient(vec2 fragcoord, int face)
+KERNEL_INLINE void gradient_span(const shader_uniforms *uniforms, const fragment_span *span)
 {
-    vec4 pixel = (vec4){fragcoord.x/SIDE_LENGTH, fragcoord.y/SIDE_LENGTH, 1, 0.8};
-    return pixel;
+    for (int i = 0; i < span->count; i++) {
+        span->r[i] = span->u[i] / uniforms->resolution[0];
+        span->g[i] = span->v[i] / uniforms->resolution[1];
+        span->b[i] = 1;
+        span->a[i] = 0.8;
+    }
 }
 
-vec4 checker_pattern(vec2 fragcoord, int face)
+KERNEL_INLINE void checker_pattern_span(const shader_uniforms *uniforms, const fragment_span *span)
 {
-    int x = fragcoord.x;
-    int y = fragcoord.y;
+    int width = uniforms->resolution[0];
+    int height = uniforms->resolution[1];
     int n = 8;
-    double value = (((((x*n)/SIDE_LENGTH)+((y*n)/SIDE_LENGTH)%2))%2);
-    vec4 pixel = (vec4){0, value/2, value, 0.8+value/8};
-    return pixel;
+    for (int i = 0; i < span->count; i++) {
+        int x = span->u[i];
+        int y = span->v[i];
+        float value = (((((x*n)/width)+((y*n)/height)%2))%2);
+        span->r[i] = 0;
+        span->g[i] = value/2;
+        span->b[i] = value;
+        span->a[i] = 0.8+value/8;
+    }
 }
 
 #ifdef IMAGE
-vec4 image(vec2 fragcoord, int face)
+KERNEL_INLINE void image_span(const shader_uniforms *uniforms, const fragment_span *span)
 {
-    int value = (round(fragcoord.y) * SIDE_LENGTH + round(fragcoord.x))*3;
-    vec4 pixel;
-    pixel.x = image_data[value];
-    pixel.y = image_data[value+1];
-    pixel.z = image_data[value+2];
-    pixel.w = 255;
-    pixel = scale_vec4(pixel, 1.0/255.0);
-    return pixel;
+    for (int i = 0; i < span->count; i++) {
+        int value = (roundf(span->v[i]) * SIDE_LENGTH + roundf(span->u[i]))*3;
+        span->r[i] = image_data[value] / 255.0f;
+        span->g[i] = image_data[value+1] / 255.0f;
+        span->b[i] = image_data[value+2] / 255.0f;
+        span->a[i] = 1;
+    }
 }
 #endif
+
+#ifdef VIDEO_FACES
+// Each face plays its clip from VIDEO_FACES, stretched over the face.
+// Faces without one get the checker pattern
+KERNEL_INLINE void video_span(const shader_uniforms *uniforms, const fragment_span *span)
+{
+    for (int i = 0; i < span->count; i++) {
+        const video_texture *texture = &video_textures[span->face[i]];
+        if (texture->pixels == NULL) {
+            fragment_span fragment = {1, &span->u[i], &span->v[i], &span->face[i],
+                &span->r[i], &span->g[i], &span->b[i], &span->a[i]};
+            checker_pattern_span(uniforms, &fragment);
+            continue;
+        }
+        int x = span->u[i] * texture->width / uniforms->resolution[0];
+        int y = span->v[i] * texture->height / uniforms->resolution[1];
+        x = x < texture->width ? x : texture->width - 1;
+        y = y < texture->height ? y : texture->height - 1;
+        uint32_t pixel = texture->pixels[y * texture->width + x];
+        span->r[i] = ((pixel >> 16) & 0xFF) / 255.0f;
+        span->g[i] = ((pixel >> 8) & 0xFF) / 255.0f;
+        span->b[i] = (pixel & 0xFF) / 255.0f;
+        span->a[i] = 1;
+    }
+}
+#endif
+
+const span_shader solid_white = {SHADER_ABI_VERSION, "solid_white", solid_white_span};
+const span_shader gradient = {SHADER_ABI_VERSION, "gradient", gradient_span};
+const span_shader checker_pattern = {SHADER_ABI_VERSION, "checker_pattern", checker_pattern_span};
+#ifdef IMAGE
+const span_shader image = {SHADER_ABI_VERSION, "image", image_span};
+#endif
+#ifdef VIDEO_FACES
+const span_shader video = {SHADER_ABI_VERSION, "video", video_span};
+#endif
+
+const span_shader *builtin_shaders[] = {
+    &solid_white,
+    &gradient,
+    &checker_pattern,
+#ifdef IMAGE
+    &image,
+#endif
+#ifdef VIDEO_FACES
+    &video,
+#endif
+};
+#define BUILTIN_SHADER_COUNT (int)(sizeof(builtin_shaders) / sizeof(builtin_shaders[0]))
+
+// Shades a span with the frame's shader. Built in shaders are compiled
+// into the calling kernel, plugins go through their function pointer
+KERNEL_INLINE void shade_fragments(const span_shader *shader, const shader_uniforms *uniforms, const fragment_span *span)
+{
+    if (shader == &solid_white)
+        solid_white_span(uniforms, span);
+    else if (shader == &gradient)
+        gradient_span(uniforms, span);
+    else if (shader == &checker_pattern)
+        checker_pattern_span(uniforms, span);
+#ifdef IMAGE
+    else if (shader == &image)
+        image_span(uniforms, span);
+#endif
+#ifdef VIDEO_FACES
+    else if (shader == &video)
+        video_span(uniforms, span);
+#endif
+    else
+        shader->shade(uniforms, span);
+}
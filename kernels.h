@@ -0,0 +1,180 @@
+// Render kernels
+// This file is included once per instruction set by render.h, with
+// KERNEL_VARIANT naming the variant and a matching GCC target pragma
+// around it. The per-pixel helpers are KERNEL_INLINE so each variant
+// gets its own copy of the whole per-pixel path
+
+// Ray casts every downscaled sample on screen, inside the bounding box,
+// and clears what the previous frame left outside of it. Samples are
+// shaded a span at a time, each one once no matter how many pixels
+// of its block end up painted
+void KERNEL(render_pixels)(char buffer[], int width, int height,
+    vec2 min_coords, vec2 max_coords, int downscaling_factor, const uniforms *frame)
+{
+    uint32_t colors[SPAN_SAMPLES];
+    for (int j = 0; j < height; j += downscaling_factor) {
+        int span_start = 0;
+        int span_count = 0;
+        for (int i = 0; i < width; i += downscaling_factor) {
+            if (i >= (int)min_coords.x && i <= (int)max_coords.x &&
+                j >= (int)min_coords.y && j <= (int)max_coords.y) {
+                if (i >= span_start + span_count * downscaling_factor) {
+                    int remaining = ((int)max_coords.x - i) / downscaling_factor + 1;
+                    span_start = i;
+                    span_count = remaining < SPAN_SAMPLES ? remaining : SPAN_SAMPLES;
+                    shade_samples(i, j, downscaling_factor, span_count, frame, colors, NULL);
+                }
+                paint_block(i, j, downscaling_factor, colors[(i - span_start) / downscaling_factor], buffer, width);
+            } else {
+                clear_block(i, j, downscaling_factor, buffer, width);
+            }
+        }
+    }
+}
+
+// Same output as render_pixels(), but only half the samples are shaded
+// and the rest is reconstructed from the last frame, see checkerboard.h
+void KERNEL(render_checkerboard)(char buffer[], int width, int height,
+    vec2 min_coords, vec2 max_coords, int downscaling_factor, const uniforms *frame,
+    sample_history *history)
+{
+    int ds = downscaling_factor;
+    int first_column = ((int)min_coords.x + ds - 1) / ds;
+    int last_column = (int)max_coords.x / ds;
+    int first_row = ((int)min_coords.y + ds - 1) / ds;
+    int last_row = (int)max_coords.y / ds;
+    uint32_t *colors = history->colors[history->current];
+    signed char *faces = history->faces[history->current];
+    int full = !history->valid;
+
+    // Shade this frame's half of the samples
+    for (int row = 0; row < history->rows; row++) {
+        size_t row_index = (size_t)row * history->columns;
+        if (row < first_row || row > last_row || first_column > last_column) {
+            memset(faces + row_index, SAMPLE_NONE, history->columns);
+            continue;
+        }
+        memset(faces + row_index, SAMPLE_NONE, first_column);
+        if (last_column + 1 < history->columns)
+            memset(faces + row_index + last_column + 1, SAMPLE_NONE, history->columns - last_column - 1);
+
+        int column = first_column;
+        int stride = 1;
+        if (!full) {
+            column += (first_column + row + history->frame) & 1;
+            stride = 2;
+        }
+        while (column <= last_column) {
+            int count = (last_column - column) / stride + 1;
+            count = count < SPAN_SAMPLES ? count : SPAN_SAMPLES;
+            uint32_t span_colors[SPAN_SAMPLES];
+            signed char span_faces[SPAN_SAMPLES];
+            shade_samples(column * ds, row * ds, stride * ds, count, frame, span_colors, span_faces);
+            for (int s = 0; s < count; s++) {
+                colors[row_index + column + s*stride] = span_colors[s];
+                faces[row_index + column + s*stride] = span_faces[s];
+            }
+            column += count * stride;
+        }
+    }
+
+    // Fill in the other half and paint everything
+    for (int row = 0; row < history->rows; row++) {
+        size_t row_index = (size_t)row * history->columns;
+        int j = row * ds;
+        for (int column = 0; column < history->columns; column++) {
+            int i = column * ds;
+            if (row < first_row || row > last_row || column < first_column || column > last_column) {
+                clear_block(i, j, ds, buffer, width);
+                continue;
+            }
+            size_t index = row_index + column;
+            if (!full && ((column + row + history->frame) & 1)) {
+                vec3 local_point;
+                // Neighbors left and right were shaded this frame, when
+                // they are inside the box
+                int hint = SAMPLE_NONE;
+                if (column > first_column)
+                    hint = faces[index - 1];
+                else if (column < last_column)
+                    hint = faces[index + 1];
+                int face = front_face(i, j, frame, hint, &local_point);
+                uint32_t color;
+                if (face == SAMPLE_NONE) {
+                    colors[index] = pack_color((vec4){0, 0, 0, 0});
+                    faces[index] = SAMPLE_NONE;
+                } else if (reproject_sample(history, local_point, face, &color) ||
+                           interpolate_sample(history, column, row, face, &color)) {
+                    colors[index] = color;
+                    faces[index] = face | SAMPLE_RECONSTRUCTED;
+                } else {
+                    signed char shaded_face;
+                    shade_samples(i, j, ds, 1, frame, &colors[index], &shaded_face);
+                    faces[index] = shaded_face;
+                }
+            }
+            paint_block(i, j, ds, colors[index], buffer, width);
+        }
+    }
+
+    history->previous = setup_reprojection(frame);
+    history->valid = 1;
+    history->frame++;
+    history->current = !history->current;
+}
+
+void KERNEL(blur)(char pixels[], vec2 min_coords, vec2 max_coords, int width, int height)
+{
+    blur_pixels(pixels, min_coords, max_coords, width, height);
+}
+
+// Copies a row with non-temporal stores, so the frame doesn't evict
+// the render threads' data from the cache on its way to the framebuffer
+void KERNEL(stream_copy)(char *dst, const char *src, size_t size)
+{
+#if defined(__AVX512F__)
+    const size_t step = 64;
+#elif defined(__AVX__)
+    const size_t step = 32;
+#elif defined(__SSE2__)
+    const size_t step = 16;
+#else
+    const size_t step = 0;
+#endif
+    if (step == 0 || size < 2 * step) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    // Streaming stores need an aligned destination
+    size_t head = (step - ((uintptr_t)dst & (step - 1))) & (step - 1);
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + step <= size; i += step) {
+#if defined(__AVX512F__)
+        _mm512_stream_si512((void *)(dst + i), _mm512_loadu_si512((const void *)(src + i)));
+#elif defined(__AVX__)
+        _mm256_stream_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+#elif defined(__SSE2__)
+        _mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+#endif
+    }
+    memcpy(dst + i, src + i, size - i);
+}
+
+// Copies the finished frame to the framebuffer row by row,
+// rows there are line_length bytes apart
+void KERNEL(present)(char *fbp, const char buffer[], int width, int height, int line_length)
+{
+    for (int y = 0; y < height; y++) {
+        if (STREAMING_PRESENT)
+            KERNEL(stream_copy)(fbp + (size_t)y*line_length, buffer + (size_t)y*width*4, (size_t)width*4);
+        else
+            memcpy(fbp + (size_t)y*line_length, buffer + (size_t)y*width*4, (size_t)width*4);
+    }
+#if defined(__SSE2__)
+    // Make the streamed data visible before the next frame starts
+    if (STREAMING_PRESENT)
+        _mm_sfence();
+#endif
+}
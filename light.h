@@ -1,9 +1,213 @@
+#define LIGHT_POINT 0
+#define LIGHT_DIRECTIONAL 1
+#define MAX_LIGHTS 16
+#define AMBIENT_LIGHT 0.2 // What every face gets, lit or not
+
 typedef struct light3
 {
-   vec3 color;
+   int type; // LIGHT_POINT or LIGHT_DIRECTIONAL
 
-   // 3D position of the light source
+   // 3D position of a point light, or the direction
+   // a directional light shines towards
    vec3 position;
-   
+
+   vec3 color;
+   double intensity;
+   double range; // Point lights fade out up to this distance, 0 for never
+
 } light3;
 
+// Specular falloff pow(x, SPECULAR_EXPONENT) tabulated over [0, 1]
+// and linearly interpolated, so shading doesn't call pow per pixel
+#define SPECULAR_SMOOTHNESS 0.2
+#define SPECULAR_EXPONENT (SPECULAR_SMOOTHNESS * 100)
+#define SPECULAR_TABLE_SIZE 1024
+
+double specular_table[SPECULAR_TABLE_SIZE + 2];
+
+void setup_specular_table()
+{
+    for (int i = 0; i <= SPECULAR_TABLE_SIZE; i++)
+        specular_table[i] = pow((double)i / SPECULAR_TABLE_SIZE, SPECULAR_EXPONENT);
+    // Padding so interpolating at exactly 1.0 stays in bounds
+    specular_table[SPECULAR_TABLE_SIZE + 1] = 1;
+}
+
+KERNEL_INLINE double specular_lookup(double x)
+{
+    // Written so NaN lands here too instead of indexing the table
+    if (!(x > 0))
+        return 0;
+    if (x >= 1)
+        return 1;
+    double position = x * SPECULAR_TABLE_SIZE;
+    int index = (int)position;
+    double fraction = position - index;
+    return specular_table[index] + (specular_table[index + 1] - specular_table[index]) * fraction;
+}
+
+// A light as the cube sees it this frame
+typedef struct light_source
+{
+    vec3 local; // Position in cube space, or the unit vector towards
+                // a directional light
+    vec3 color; // Times intensity
+    double inverse_range_squared; // 0 if it doesn't fade
+    int directional;
+} light_source;
+
+// Lighting terms that are constant over a whole cube face
+typedef struct face_lighting
+{
+    vec3 normal;       // World space normal
+    vec3 normal_local; // Cube space normal
+
+    // Distances along the normal from the face plane to each light
+    // and to the camera. Every point on the face shares them, so
+    // dot(light - intersection, normal) never has to be done per pixel.
+    // For directional lights it's already the cosine
+    double light_distance[MAX_LIGHTS];
+    double view_distance;
+
+    // The lights that can reach the face, the only ones shaded against
+    unsigned char lights[MAX_LIGHTS];
+    int light_count;
+} face_lighting;
+
+// Built once per frame with setup_lighting()
+typedef struct lighting_cache
+{
+    light_source lights[MAX_LIGHTS];
+    int light_count;
+    vec3 view_local;  // Camera focal point in cube space
+    face_lighting faces[6];
+} lighting_cache;
+
+// Cube space normals and plane offsets of each face,
+// in the same order the ray caster tests them.
+// Normals point into the cube, so lit faces have the light at a
+// negative distance
+static const vec3 face_normals[6] = {
+    {0, 0, 1}, {0, 0, -1},
+    {1, 0, 0}, {-1, 0, 0},
+    {0, 1, 0}, {0, -1, 0}
+};
+static const double face_planes[6] = {
+    -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1,
+    -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1,
+    -SIDE_LENGTH / 2.0, SIDE_LENGTH / 2.0 - 1
+};
+
+// Distance from a cube space point to the closest point of a face
+double distance_to_face(vec3 point, int face)
+{
+    double low = -SIDE_LENGTH / 2.0, high = SIDE_LENGTH / 2.0 - 1;
+    vec3 closest = {fmin(fmax(point.x, low), high), fmin(fmax(point.y, low), high),
+        fmin(fmax(point.z, low), high)};
+    if (face_normals[face].x) closest.x = face_planes[face];
+    if (face_normals[face].y) closest.y = face_planes[face];
+    if (face_normals[face].z) closest.z = face_planes[face];
+    return length_vec3(subtract_vec3(point, closest));
+}
+
+// lights has count <= MAX_LIGHTS entries. Each face keeps the lights in
+// front of it and, for point lights, close enough to some part of it
+lighting_cache setup_lighting(const light3 lights[], int count, vec3 view_position,
+    mat4 world_to_cube, mat4 cube_to_world)
+{
+    lighting_cache cache;
+    cache.light_count = count;
+
+    // Work in cube space so intersections and normals never need rotating
+    cache.view_local = transform_point_mat4(world_to_cube, view_position);
+    for (int l = 0; l < count; l++) {
+        light_source *light = &cache.lights[l];
+        light->directional = lights[l].type == LIGHT_DIRECTIONAL;
+        light->color = scale_vec3(lights[l].color, lights[l].intensity);
+        light->local = light->directional
+            ? normalize_vec3(scale_vec3(transform_direction_mat4(world_to_cube, lights[l].position), -1))
+            : transform_point_mat4(world_to_cube, lights[l].position);
+        light->inverse_range_squared = !light->directional && lights[l].range > 0
+            ? 1 / (lights[l].range * lights[l].range) : 0;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        face_lighting *face = &cache.faces[i];
+        face->normal_local = face_normals[i];
+        face->normal = transform_direction_mat4(cube_to_world, face_normals[i]);
+
+        // Point on the plane dotted with its normal
+        double plane = face_planes[i] * (face_normals[i].x + face_normals[i].y + face_normals[i].z);
+        face->view_distance = dot_product_vec3(cache.view_local, face->normal_local) - plane;
+
+        face->light_count = 0;
+        for (int l = 0; l < count; l++) {
+            const light_source *light = &cache.lights[l];
+            double distance = light->directional
+                ? dot_product_vec3(light->local, face->normal_local)
+                : dot_product_vec3(light->local, face->normal_local) - plane;
+            face->light_distance[l] = distance;
+            if (distance >= 0 || (light->color.x <= 0 && light->color.y <= 0 && light->color.z <= 0))
+                continue;
+            if (lights[l].range > 0 && !light->directional && distance_to_face(light->local, i) >= lights[l].range)
+                continue;
+            face->lights[face->light_count++] = l;
+        }
+    }
+    return cache;
+}
+
+// Shades a pixel lying on a face, given its cube space position.
+// Only the lights left for the face cost anything
+KERNEL_INLINE vec4 apply_lighting(vec4 pixel, vec3 intersection_local, int face, const lighting_cache *lighting)
+{
+    const face_lighting *face_light = &lighting->faces[face];
+    vec3 diffuse = {AMBIENT_LIGHT, AMBIENT_LIGHT, AMBIENT_LIGHT};
+    vec3 specular = {0, 0, 0};
+
+    vec3 to_view = {0, 0, 0};
+    double ndotv = 0;
+    if (SPECULAR_HIGHLIGHT && face_light->light_count > 0) {
+        to_view = subtract_vec3(lighting->view_local, intersection_local);
+        double view_length_sq = dot_product_vec3(to_view, to_view);
+        double view_inv = view_length_sq > 0 ? 1 / sqrt(view_length_sq) : 0;
+        to_view = scale_vec3(to_view, view_inv);
+        ndotv = face_light->view_distance * view_inv;
+    }
+
+    for (int l = 0; l < face_light->light_count; l++) {
+        int index = face_light->lights[l];
+        const light_source *light = &lighting->lights[index];
+        vec3 to_light = light->local;
+        double ndotl = face_light->light_distance[index];
+        vec3 color = light->color;
+        if (!light->directional) {
+            to_light = subtract_vec3(light->local, intersection_local);
+            double light_length_sq = dot_product_vec3(to_light, to_light);
+            double light_inv = light_length_sq > 0 ? 1 / sqrt(light_length_sq) : 0;
+            to_light = scale_vec3(to_light, light_inv);
+            ndotl *= light_inv;
+            if (light->inverse_range_squared > 0) {
+                double fade = 1 - light_length_sq * light->inverse_range_squared;
+                if (fade <= 0)
+                    continue;
+                color = scale_vec3(color, fade * fade);
+            }
+        }
+
+        // Culling left lights in front of the face only, ndotl is negative
+        diffuse = add_vec3(diffuse, scale_vec3(color, -ndotl));
+        if (SPECULAR_HIGHLIGHT) {
+            // dot(view, reflect(-light, normal)) expanded, both unit length
+            double ldotv = dot_product_vec3(to_light, to_view);
+            double spec = specular_lookup(2 * ndotl * ndotv - ldotv);
+            specular = add_vec3(specular, scale_vec3(color, spec));
+        }
+    }
+
+    pixel.x = pixel.x * diffuse.x / (1 + AMBIENT_LIGHT) + specular.x;
+    pixel.y = pixel.y * diffuse.y / (1 + AMBIENT_LIGHT) + specular.y;
+    pixel.z = pixel.z * diffuse.z / (1 + AMBIENT_LIGHT) + specular.z;
+    pixel.w = 1;
+    return pixel;
+}
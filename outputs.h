@@ -0,0 +1,364 @@
+// Framebuffer outputs
+// Every device in FB_OUTPUTS gets its own shadow buffer and is drawn at
+// its own resolution and pixel format, with its own view of the scene.
+// Output 0 is drawn on the main thread and every other one on a thread
+// of its own, so screens render in parallel and a frame takes as long
+// as the slowest of them. The main loop paces frames for all of them.
+//
+// With PIPELINED_PRESENT every framebuffer gets a second draw buffer and
+// a present thread. Frames alternate between the two buffers: while the
+// present thread writes frame N out to the (uncached) framebuffer, frame
+// N+1 is drawn into the other buffer. Drawing frame N+2 waits for frame
+// N to be out, so the screen is never more than one frame behind
+
+#define MAX_OUTPUTS 8
+
+typedef struct output_config
+{
+    const char *device;
+    int x, y; // Where this screen's view sits on the shared view plane, in pixels
+} output_config;
+
+// Single producer, single consumer handoff of finished frames. The
+// counters are the queue, buffer n % 2 holds frame n. The semaphores
+// only put either side to sleep when there's nothing for it to do
+typedef struct present_queue
+{
+    unsigned long submitted; // Written by the drawing thread only
+    unsigned long presented; // Written by the present thread only
+    const render_kernels *kernels; // Of the last frame submitted
+    sem_t ready; // Frames submitted and not presented yet
+    sem_t free; // Buffers nobody is drawing into or presenting
+    pthread_t thread;
+    int running;
+} present_queue;
+
+typedef struct output
+{
+    output_config config;
+    int fbfd;
+    char *fbp;
+    long screensize;
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+
+    // Drawn as BGRA no matter what the screen takes. buffer is the one
+    // the current (or last) frame is drawn into, one of buffers
+    char *buffer;
+    char *buffers[2]; // The second one only with PIPELINED_PRESENT
+    size_t buffer_size;
+    present_queue present;
+
+    // Bounding box of the last frame drawn
+    vec2 min_coords;
+    vec2 max_coords;
+
+    sample_history history; // With CHECKERBOARD
+
+    // Opened by the thread drawing the output, with PERF_COUNTERS
+    perf_counters perf;
+    int perf_setup;
+    perf_counters present_perf; // Of the present thread
+
+    struct output_pool *pool;
+    pthread_t thread;
+} output;
+
+typedef void (*output_draw_function)(output *out, void *context);
+
+typedef struct output_pool
+{
+    output *outputs;
+    int count;
+    output_draw_function draw;
+    void *context;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; // A frame started, or the pool is stopping
+    pthread_cond_t finished; // Every thread finished its frame
+    unsigned long frame;
+    int pending; // Threads still drawing the current frame
+    int stopping;
+    int present_count; // Outputs that may have a present thread
+} output_pool;
+
+void close_output(output *out)
+{
+    if (out->fbp) {
+        munmap(out->fbp, out->screensize);
+        out->fbp = NULL;
+    }
+    if (out->fbfd >= 0) {
+        close(out->fbfd);
+        out->fbfd = -1;
+    }
+    free_shadow_buffer(out->buffers[0], out->buffer_size);
+    free_shadow_buffer(out->buffers[1], out->buffer_size);
+    out->buffers[0] = out->buffers[1] = out->buffer = NULL;
+    close_perf_counters(&out->perf);
+    close_perf_counters(&out->present_perf);
+    free_sample_history(&out->history);
+}
+
+void close_outputs(output outputs[], int count)
+{
+    for (int i = 0; i < count; i++)
+        close_output(&outputs[i]);
+}
+
+// Maps the framebuffer and allocates the shadow buffer, seeded with
+// what's on screen so text under the cube survives
+int open_output(output *out, output_config config)
+{
+    memset(out, 0, sizeof(output));
+    out->config = config;
+    out->fbfd = open(config.device, O_RDWR);
+    if (out->fbfd == -1) {
+        fprintf(stderr, "Error opening framebuffer device '%s': %s\n", config.device, strerror(errno));
+        return 0;
+    }
+
+    if (ioctl(out->fbfd, FBIOGET_VSCREENINFO, &out->vinfo)) {
+        perror("Error reading variable information");
+        close_output(out);
+        return 0;
+    }
+
+    if (ioctl(out->fbfd, FBIOGET_FSCREENINFO, &out->finfo)) {
+        perror("Error reading fixed information");
+        close_output(out);
+        return 0;
+    }
+
+    if (out->vinfo.bits_per_pixel != 32 && out->vinfo.bits_per_pixel != 16) {
+        fprintf(stderr, "%s: %d bits per pixel is not supported, only 32 and 16 are\n",
+            config.device, out->vinfo.bits_per_pixel);
+        close_output(out);
+        return 0;
+    }
+
+    out->screensize = out->vinfo.yres_virtual * out->finfo.line_length;
+    out->fbp = (char*)mmap(0, out->screensize, PROT_READ | PROT_WRITE, MAP_SHARED, out->fbfd, 0);
+    if ((intptr_t)out->fbp == -1) {
+        out->fbp = NULL;
+        perror("Error mapping framebuffer to memory");
+        close_output(out);
+        return 0;
+    }
+
+    out->buffer_size = (size_t)out->vinfo.xres * out->vinfo.yres * 4;
+    for (int i = 0; i < (PIPELINED_PRESENT ? 2 : 1); i++) {
+        out->buffers[i] = alloc_shadow_buffer(out->buffer_size);
+        if (out->buffers[i] == NULL) {
+            perror("Error allocating draw buffer");
+            close_output(out);
+            return 0;
+        }
+        if (out->vinfo.bits_per_pixel == 32) {
+            for (int y = 0; y < out->vinfo.yres; y++)
+                memcpy(out->buffers[i] + (size_t)y*out->vinfo.xres*4,
+                    out->fbp + (size_t)y*out->finfo.line_length, 4 * out->vinfo.xres);
+        }
+    }
+    out->buffer = out->buffers[0];
+    return 1;
+}
+
+// Takes an 8 bit channel down to the bitfield the driver describes
+uint32_t output_channel(uint32_t value, struct fb_bitfield field)
+{
+    return (field.length < 8 ? value >> (8 - field.length) : value) << field.offset;
+}
+
+// Screens that take 32 bit pixels get the frame copied by the present
+// kernel, the rest get every pixel repacked into their layout
+void present_output(output *out, const char buffer[], const render_kernels *kernels)
+{
+    int width = out->vinfo.xres;
+    int height = out->vinfo.yres;
+    if (out->vinfo.bits_per_pixel == 32) {
+        kernels->present(out->fbp, buffer, width, height, out->finfo.line_length);
+        return;
+    }
+
+    const uint32_t *pixels = (const uint32_t *)buffer;
+    for (int y = 0; y < height; y++) {
+        uint16_t *row = (uint16_t *)(out->fbp + (size_t)y*out->finfo.line_length);
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = pixels[(size_t)y*width + x];
+            row[x] = output_channel((pixel >> 16) & 0xFF, out->vinfo.red)
+                | output_channel((pixel >> 8) & 0xFF, out->vinfo.green)
+                | output_channel(pixel & 0xFF, out->vinfo.blue);
+        }
+    }
+}
+
+void *present_thread(void *arg)
+{
+    output *out = arg;
+    present_queue *queue = &out->present;
+    if (PERF_COUNTERS)
+        setup_perf_counters(&out->present_perf);
+    while (1) {
+        while (sem_wait(&queue->ready) && errno == EINTR);
+        // Woken up with nothing left to present means stop
+        unsigned long submitted = __atomic_load_n(&queue->submitted, __ATOMIC_ACQUIRE);
+        if (queue->presented == submitted)
+            break;
+
+        begin_perf_stage(&out->present_perf);
+        present_output(out, out->buffers[queue->presented % 2], queue->kernels);
+        end_perf_stage(&out->present_perf, STAGE_PRESENT, (double)out->vinfo.xres * out->vinfo.yres);
+        __atomic_store_n(&queue->presented, queue->presented + 1, __ATOMIC_RELEASE);
+        sem_post(&queue->free);
+    }
+    return NULL;
+}
+
+int start_present_thread(output *out)
+{
+    present_queue *queue = &out->present;
+    sem_init(&queue->ready, 0, 0);
+    sem_init(&queue->free, 0, 2);
+    if (pthread_create(&queue->thread, NULL, present_thread, out)) {
+        perror("Error starting present thread");
+        return 0;
+    }
+    queue->running = 1;
+    return 1;
+}
+
+// Presents what was submitted so far and stops the thread
+void stop_present_thread(output *out)
+{
+    present_queue *queue = &out->present;
+    if (!queue->running)
+        return;
+    sem_post(&queue->ready);
+    pthread_join(queue->thread, NULL);
+    sem_destroy(&queue->ready);
+    sem_destroy(&queue->free);
+    queue->running = 0;
+}
+
+// Picks the buffer to draw the next frame into, waiting for it to be
+// presented if the present thread is a frame behind
+void begin_output_frame(output *out)
+{
+    present_queue *queue = &out->present;
+    if (!queue->running)
+        return;
+    while (sem_wait(&queue->free) && errno == EINTR);
+    out->buffer = out->buffers[queue->submitted % 2];
+}
+
+// Presents the frame just drawn, or hands it to the present thread
+void finish_output_frame(output *out, const render_kernels *kernels)
+{
+    present_queue *queue = &out->present;
+    if (!queue->running) {
+        begin_perf_stage(&out->perf);
+        present_output(out, out->buffer, kernels);
+        end_perf_stage(&out->perf, STAGE_PRESENT, (double)out->vinfo.xres * out->vinfo.yres);
+        return;
+    }
+    queue->kernels = kernels;
+    __atomic_store_n(&queue->submitted, queue->submitted + 1, __ATOMIC_RELEASE);
+    sem_post(&queue->ready);
+}
+
+// Waits until everything submitted is on screen
+void flush_output(output *out)
+{
+    present_queue *queue = &out->present;
+    if (!queue->running)
+        return;
+    for (int i = 0; i < 2; i++)
+        while (sem_wait(&queue->free) && errno == EINTR);
+    for (int i = 0; i < 2; i++)
+        sem_post(&queue->free);
+}
+
+void *output_thread(void *arg)
+{
+    output *out = arg;
+    output_pool *pool = out->pool;
+    unsigned long frame = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->frame == frame && !pool->stopping)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stopping)
+            break;
+        frame = pool->frame;
+
+        // Each thread only touches its own output while drawing
+        pthread_mutex_unlock(&pool->lock);
+        pool->draw(out, pool->context);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Starts a thread for every output but the first, and a present thread
+// for every output with a second buffer
+int start_output_pool(output_pool *pool, output outputs[], int count,
+    output_draw_function draw, void *context)
+{
+    memset(pool, 0, sizeof(output_pool));
+    pool->outputs = outputs;
+    pool->draw = draw;
+    pool->context = context;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    pool->count = 1;
+    pool->present_count = count;
+    for (int i = 0; i < count; i++) {
+        outputs[i].pool = pool;
+        if (outputs[i].buffers[1] && !start_present_thread(&outputs[i]))
+            return 0;
+    }
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&outputs[i].thread, NULL, output_thread, &outputs[i])) {
+            perror("Error starting output thread");
+            return 0;
+        }
+        pool->count++;
+    }
+    return 1;
+}
+
+// Draws a frame on every output and waits for all of them
+void draw_outputs(output_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->frame++;
+    pool->pending = pool->count - 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->draw(&pool->outputs[0], pool->context);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void stop_output_pool(output_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->count; i++)
+        pthread_join(pool->outputs[i].thread, NULL);
+    pool->count = 1;
+    for (int i = 0; i < pool->present_count; i++)
+        stop_present_thread(&pool->outputs[i]);
+}
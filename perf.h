@@ -0,0 +1,196 @@
+// Hardware performance counters per render stage
+// With PERF_COUNTERS on, every output thread opens one perf_event group
+// counting its own user space cycles, instructions, cache misses,
+// branch misses and dTLB misses. The group is read before and after
+// each stage and the differences add up per stage. Lighting runs inside
+// each span of the raster loop, so it's counted as part of raster.
+// Counters the CPU or VM doesn't have are left out, and when
+// perf_event_paranoid (or a missing PMU) forbids the group altogether
+// the stages just aren't counted. When other perf users leave too few
+// hardware counters, the kernel multiplexes the group: counts are then
+// scaled up by how long the group was enabled over how long it really
+// counted, like perf stat does, and the report says how much of each
+// stage was counted
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_DTLB_MISSES, PERF_EVENTS };
+enum { STAGE_RASTER, STAGE_BLUR, STAGE_PRESENT, PERF_STAGES };
+
+static const char *perf_stage_names[PERF_STAGES] = {"raster", "blur", "present"};
+
+typedef struct perf_stage
+{
+    double counts[PERF_EVENTS]; // As counted, not scaled yet
+    double enabled; // Nanoseconds the group was enabled during the stage
+    double running; // And actually counting
+    double pixels; // Pixels the stage went over, for per pixel counts
+} perf_stage;
+
+typedef struct perf_counters
+{
+    int fds[PERF_EVENTS]; // -1 for counters that couldn't be opened
+    int slots[PERF_EVENTS]; // Position of each counter in a group read
+    int opened;
+    uint64_t start[PERF_EVENTS];
+    uint64_t start_enabled, start_running;
+    perf_stage stages[PERF_STAGES];
+} perf_counters;
+
+int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    // This thread, any CPU
+    return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+// Opens the counters for the calling thread. Returns 0 if there are
+// none, after saying why once
+int setup_perf_counters(perf_counters *perf)
+{
+    static const struct { uint32_t type; uint64_t config; } events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+            | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    };
+    static int warned = 0;
+
+    memset(perf, 0, sizeof(perf_counters));
+    int leader = -1;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // User space only, which perf_event_paranoid 2 still allows
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf->fds[i] = perf_event_open(&attr, leader);
+        perf->slots[i] = perf->opened;
+        if (perf->fds[i] < 0) {
+            if (i == PERF_CYCLES) {
+                if (!warned) {
+                    fprintf(stderr, "Performance counters unavailable: %s", strerror(errno));
+                    FILE *paranoid = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+                    int level;
+                    if (paranoid && fscanf(paranoid, "%d", &level) == 1)
+                        fprintf(stderr, " (perf_event_paranoid is %d)", level);
+                    if (paranoid)
+                        fclose(paranoid);
+                    fprintf(stderr, "\n");
+                    warned = 1;
+                }
+                return 0;
+            }
+            continue;
+        }
+        if (leader < 0)
+            leader = perf->fds[i];
+        perf->opened++;
+    }
+    return 1;
+}
+
+void close_perf_counters(perf_counters *perf)
+{
+    if (!perf->opened)
+        return;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (perf->fds[i] >= 0)
+            close(perf->fds[i]);
+    }
+    perf->opened = 0;
+}
+
+// A group read is the counter count, the time enabled, the time
+// running and then the values
+int read_perf_counters(perf_counters *perf, uint64_t values[PERF_EVENTS], uint64_t *enabled, uint64_t *running)
+{
+    uint64_t group[3 + PERF_EVENTS];
+    if (read(perf->fds[PERF_CYCLES], group, sizeof(group)) < (ssize_t)(sizeof(uint64_t) * (3 + perf->opened)))
+        return 0;
+    *enabled = group[1];
+    *running = group[2];
+    for (int i = 0; i < PERF_EVENTS; i++)
+        values[i] = perf->fds[i] >= 0 ? group[3 + perf->slots[i]] : 0;
+    return 1;
+}
+
+void begin_perf_stage(perf_counters *perf)
+{
+    if (perf->opened && !read_perf_counters(perf, perf->start, &perf->start_enabled, &perf->start_running))
+        close_perf_counters(perf);
+}
+
+void end_perf_stage(perf_counters *perf, int stage, double pixels)
+{
+    uint64_t end[PERF_EVENTS];
+    uint64_t enabled, running;
+    if (!perf->opened || !read_perf_counters(perf, end, &enabled, &running))
+        return;
+    for (int i = 0; i < PERF_EVENTS; i++)
+        perf->stages[stage].counts[i] += end[i] - perf->start[i];
+    perf->stages[stage].enabled += enabled - perf->start_enabled;
+    perf->stages[stage].running += running - perf->start_running;
+    perf->stages[stage].pixels += pixels;
+}
+
+// Reports and resets the counts of every output's counters together
+void report_perf_counters(FILE *file, perf_counters *perfs[], int count, int frames)
+{
+    perf_stage totals[PERF_STAGES];
+    memset(totals, 0, sizeof(totals));
+    int available[PERF_EVENTS] = {0};
+    int any = 0;
+    for (int p = 0; p < count; p++) {
+        if (!perfs[p]->opened)
+            continue;
+        any = 1;
+        for (int i = 0; i < PERF_EVENTS; i++)
+            available[i] |= perfs[p]->fds[i] >= 0;
+        for (int s = 0; s < PERF_STAGES; s++) {
+            // Scaled per output, each group is multiplexed on its own
+            const perf_stage *stage = &perfs[p]->stages[s];
+            double scale = stage->running > 0 ? stage->enabled / stage->running : 0;
+            for (int i = 0; i < PERF_EVENTS; i++)
+                totals[s].counts[i] += stage->counts[i] * scale;
+            totals[s].enabled += stage->enabled;
+            totals[s].running += stage->running;
+            totals[s].pixels += stage->pixels;
+        }
+        memset(perfs[p]->stages, 0, sizeof(perfs[p]->stages));
+    }
+    if (!any || frames == 0)
+        return;
+
+    static const char *columns[PERF_EVENTS] = {"cycles/px", "instr/px", "cache-miss/px", "branch-miss/px", "dTLB-miss/px"};
+    fprintf(file, "Performance counters over %d frames\n%-8s %8s", frames, "stage", "IPC");
+    for (int i = 0; i < PERF_EVENTS; i++)
+        fprintf(file, " %14s", columns[i]);
+    fprintf(file, " %8s\n", "counted");
+    for (int s = 0; s < PERF_STAGES; s++) {
+        if (totals[s].pixels == 0)
+            continue;
+        const double *counts = totals[s].counts;
+        if (available[PERF_INSTRUCTIONS] && counts[PERF_CYCLES])
+            fprintf(file, "%-8s %8.2f", perf_stage_names[s], counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+        else
+            fprintf(file, "%-8s %8s", perf_stage_names[s], "-");
+        for (int i = 0; i < PERF_EVENTS; i++) {
+            if (available[i])
+                fprintf(file, " %14.3f", counts[i] / totals[s].pixels);
+            else
+                fprintf(file, " %14s", "-");
+        }
+        // Below 100% the counts are estimates, scaled from that share
+        if (totals[s].enabled > 0)
+            fprintf(file, " %7.1f%%\n", 100 * totals[s].running / totals[s].enabled);
+        else
+            fprintf(file, " %8s\n", "-");
+    }
+}
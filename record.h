@@ -0,0 +1,403 @@
+// Frame recording
+// The render thread copies the changed region of each presented frame
+// into a bounded ring of preallocated slots and returns immediately.
+// A writer thread delta encodes each frame against the previous one
+// (XOR), run length encodes the result and appends it to the stream.
+//
+// Stream layout (all integers little endian):
+//   record_file_header
+//   record_frame_header + payload, one per frame
+//   record_index_entry * frame_count
+//   record_file_footer
+// Every RECORD_KEYFRAME_INTERVAL frames a full, non-delta frame is
+// stored so the index at the end can be used to seek. Streams cut short
+// (crash, power loss) have no index but can still be read sequentially
+
+#define RECORD_MAGIC "TTYCREC1"
+#define RECORD_INDEX_MAGIC "TTYCIDX1"
+#define RECORD_FRAME_MAGIC 0x454d5246u // "FRME"
+#define RECORD_FORMAT_BGRA32 1
+#define RECORD_FLAG_KEYFRAME 1
+#define RECORD_QUEUE_SLOTS 8
+#define RECORD_KEYFRAME_INTERVAL 60
+
+typedef struct record_rect
+{
+    int x, y;
+    int width, height;
+} record_rect;
+
+typedef struct record_file_header
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t reserved;
+} record_file_header;
+
+typedef struct record_frame_header
+{
+    uint32_t magic;
+    uint32_t index;
+    uint64_t timestamp_us; // Since the start of the recording
+    uint32_t flags;
+    uint32_t x, y, width, height; // Region the payload covers
+    uint32_t payload_size;
+} record_frame_header;
+
+typedef struct record_index_entry
+{
+    uint64_t offset; // Of the frame header from the start of the file
+    uint64_t timestamp_us;
+    uint32_t flags;
+    uint32_t reserved;
+} record_index_entry;
+
+typedef struct record_file_footer
+{
+    uint64_t index_offset;
+    uint32_t frame_count;
+    uint32_t reserved;
+    char magic[8];
+} record_file_footer;
+
+
+// Run length encoding over 32 bit pixels
+// Each token starts with a control byte c:
+//   c & 0x80: the next pixel repeated (c & 0x7f) + 1 times
+//   else:     (c + 1) literal pixels follow
+// Worst case output is pixels * 4 + pixels / 128 + 1 bytes
+
+size_t record_rle_bound(size_t pixels)
+{
+    return pixels * 4 + pixels / 128 + 1;
+}
+
+size_t record_rle_encode(const uint32_t *pixels, size_t count, unsigned char *out)
+{
+    size_t in = 0, length = 0;
+    while (in < count) {
+        size_t run = 1;
+        while (in + run < count && run < 128 && pixels[in + run] == pixels[in])
+            run++;
+        if (run > 1) {
+            out[length++] = 0x80 | (run - 1);
+            memcpy(out + length, &pixels[in], 4);
+            length += 4;
+            in += run;
+            continue;
+        }
+
+        // Gather literals until a run of at least 3 starts
+        size_t literals = 1;
+        while (in + literals < count && literals < 128) {
+            size_t next = in + literals;
+            if (next + 2 < count && pixels[next] == pixels[next + 1] && pixels[next] == pixels[next + 2])
+                break;
+            literals++;
+        }
+        out[length++] = literals - 1;
+        memcpy(out + length, &pixels[in], literals * 4);
+        length += literals * 4;
+        in += literals;
+    }
+    return length;
+}
+
+// Returns 0 on malformed input
+int record_rle_decode(const unsigned char *data, size_t size, uint32_t *pixels, size_t count)
+{
+    size_t in = 0, out = 0;
+    while (in < size && out < count) {
+        unsigned char control = data[in++];
+        size_t amount = (control & 0x7f) + 1;
+        if (out + amount > count)
+            return 0;
+        if (control & 0x80) {
+            if (in + 4 > size)
+                return 0;
+            uint32_t pixel;
+            memcpy(&pixel, data + in, 4);
+            in += 4;
+            for (size_t i = 0; i < amount; i++)
+                pixels[out++] = pixel;
+        } else {
+            if (in + amount * 4 > size)
+                return 0;
+            memcpy(pixels + out, data + in, amount * 4);
+            in += amount * 4;
+            out += amount;
+        }
+    }
+    return out == count && in == size;
+}
+
+record_rect record_rect_union(record_rect a, record_rect b)
+{
+    if (a.width <= 0 || a.height <= 0)
+        return b;
+    if (b.width <= 0 || b.height <= 0)
+        return a;
+    int x0 = a.x < b.x ? a.x : b.x;
+    int y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (record_rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// Copies a rect between full frame pixel buffers
+void record_copy_rect(uint32_t *dst, const uint32_t *src, int width, record_rect rect)
+{
+    for (int y = rect.y; y < rect.y + rect.height; y++)
+        memcpy(dst + (size_t)y*width + rect.x, src + (size_t)y*width + rect.x, rect.width * 4);
+}
+
+
+typedef struct record_slot
+{
+    uint32_t *pixels; // Only the rect, packed
+    record_rect rect;
+    uint64_t timestamp_us;
+} record_slot;
+
+typedef struct recorder
+{
+    FILE *file;
+    int width;
+    int height;
+
+    record_slot slots[RECORD_QUEUE_SLOTS];
+    unsigned int head; // Next slot the render thread fills
+    unsigned int tail; // Next slot the writer consumes
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+    int stopping;
+
+    // Render thread side
+    struct timespec start;
+    record_rect last_rect;    // Drawn area of the previous frame
+    record_rect pending_rect; // Changes from frames that were dropped
+    unsigned int dropped;
+    int resized; // The output changed size, the stream can't follow
+
+
+    // Writer side
+    uint32_t *current;  // Frame being encoded
+    uint32_t *previous; // Frame the delta is taken against
+    uint32_t *scratch;
+    unsigned char *encoded;
+    unsigned int frame_count;
+    record_index_entry *index;
+    unsigned int index_count; // Stays behind frame_count if growing fails
+    unsigned int index_capacity;
+    int failed; // A write failed, nothing more is written
+} recorder;
+
+void record_write_frame(recorder *rec, record_slot *slot)
+{
+    if (rec->failed)
+        return;
+    record_rect rect = slot->rect;
+    int keyframe = rec->frame_count % RECORD_KEYFRAME_INTERVAL == 0;
+    if (keyframe)
+        rect = (record_rect){0, 0, rec->width, rec->height};
+
+    // Bring our copy of the screen up to date
+    for (int y = 0; y < slot->rect.height; y++)
+        memcpy(rec->current + (size_t)(slot->rect.y + y)*rec->width + slot->rect.x,
+               slot->pixels + (size_t)y*slot->rect.width, slot->rect.width * 4);
+
+    // Pack the region, XORed with the previous frame unless it's a keyframe
+    size_t count = 0;
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        const uint32_t *row = rec->current + (size_t)y*rec->width + rect.x;
+        const uint32_t *previous_row = rec->previous + (size_t)y*rec->width + rect.x;
+        for (int x = 0; x < rect.width; x++)
+            rec->scratch[count++] = keyframe ? row[x] : row[x] ^ previous_row[x];
+    }
+    size_t payload_size = record_rle_encode(rec->scratch, count, rec->encoded);
+    record_copy_rect(rec->previous, rec->current, rec->width, rect);
+
+    uint32_t flags = keyframe ? RECORD_FLAG_KEYFRAME : 0;
+    if (rec->index_count == rec->index_capacity && rec->index_count == rec->frame_count) {
+        unsigned int capacity = rec->index_capacity ? rec->index_capacity * 2 : 1024;
+        record_index_entry *grown = realloc(rec->index, capacity * sizeof(record_index_entry));
+        if (grown != NULL) {
+            rec->index = grown;
+            rec->index_capacity = capacity;
+        }
+    }
+    off_t offset = ftello(rec->file);
+
+    record_frame_header header = {
+        RECORD_FRAME_MAGIC, rec->frame_count, slot->timestamp_us, flags,
+        rect.x, rect.y, rect.width, rect.height, payload_size
+    };
+    if (fwrite(&header, sizeof(header), 1, rec->file) != 1 ||
+        (payload_size && fwrite(rec->encoded, payload_size, 1, rec->file) != 1)) {
+        fprintf(stderr, "Error writing recording, stopped at frame %u: %s\n", rec->frame_count, strerror(errno));
+        rec->failed = 1;
+        return;
+    }
+
+    // The index must stay contiguous to be usable, stop at the first gap
+    if (rec->index_count < rec->index_capacity && rec->index_count == rec->frame_count) {
+        record_index_entry *entry = &rec->index[rec->index_count++];
+        entry->offset = offset;
+        entry->timestamp_us = slot->timestamp_us;
+        entry->flags = flags;
+        entry->reserved = 0;
+    }
+    rec->frame_count++;
+}
+
+void *record_writer_thread(void *arg)
+{
+    recorder *rec = arg;
+    pthread_mutex_lock(&rec->lock);
+    while (1) {
+        while (rec->tail == rec->head && !rec->stopping)
+            pthread_cond_wait(&rec->ready, &rec->lock);
+        if (rec->tail == rec->head)
+            break;
+        record_slot *slot = &rec->slots[rec->tail % RECORD_QUEUE_SLOTS];
+
+        // The render thread never touches a queued slot, encode unlocked
+        pthread_mutex_unlock(&rec->lock);
+        record_write_frame(rec, slot);
+        pthread_mutex_lock(&rec->lock);
+        rec->tail++;
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+
+int setup_recorder(recorder *rec, const char *path, int width, int height)
+{
+    memset(rec, 0, sizeof(recorder));
+    rec->width = width;
+    rec->height = height;
+
+    size_t pixels = (size_t)width * height;
+    rec->current = calloc(pixels, 4);
+    rec->previous = calloc(pixels, 4);
+    rec->scratch = malloc(pixels * 4);
+    rec->encoded = malloc(record_rle_bound(pixels));
+    int allocated = rec->current && rec->previous && rec->scratch && rec->encoded;
+    for (int i = 0; i < RECORD_QUEUE_SLOTS; i++) {
+        rec->slots[i].pixels = malloc(pixels * 4);
+        allocated = allocated && rec->slots[i].pixels;
+    }
+    if (!allocated) {
+        fprintf(stderr, "Error allocating recording buffers\n");
+        return 0;
+    }
+
+    rec->file = fopen(path, "wb");
+    if (rec->file == NULL) {
+        fprintf(stderr, "Error opening recording file '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    record_file_header header = {RECORD_MAGIC, width, height, RECORD_FORMAT_BGRA32, 0};
+    if (fwrite(&header, sizeof(header), 1, rec->file) != 1) {
+        fprintf(stderr, "Error writing recording file '%s': %s\n", path, strerror(errno));
+        fclose(rec->file);
+        rec->file = NULL;
+        return 0;
+    }
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->ready, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &rec->start);
+    if (pthread_create(&rec->thread, NULL, record_writer_thread, rec)) {
+        fprintf(stderr, "Error starting recording thread\n");
+        fclose(rec->file);
+        rec->file = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Queues a presented frame. drawn is the area this frame painted,
+// the area painted by the previous frame is added automatically.
+// Never blocks on the writer: when the queue is full the frame is
+// dropped and its changes are carried over to the next queued one.
+// Streams have one frame size, recording stops if the output resizes
+void record_frame(recorder *rec, const char buffer[], int width, int height, record_rect drawn)
+{
+    if (rec->file == NULL || rec->resized)
+        return;
+    if (width != rec->width || height != rec->height) {
+        fprintf(stderr, "Output resized to %dx%d, recording stopped at %dx%d\n",
+            width, height, rec->width, rec->height);
+        rec->resized = 1;
+        return;
+    }
+
+    record_rect rect = record_rect_union(drawn, rec->last_rect);
+    rect = record_rect_union(rect, rec->pending_rect);
+    if (rec->head == 0)
+        rect = (record_rect){0, 0, width, height};
+    rec->last_rect = drawn;
+
+    pthread_mutex_lock(&rec->lock);
+    int full = rec->head - rec->tail == RECORD_QUEUE_SLOTS;
+    pthread_mutex_unlock(&rec->lock);
+    if (full) {
+        rec->pending_rect = rect;
+        rec->dropped++;
+        return;
+    }
+    rec->pending_rect = (record_rect){0, 0, 0, 0};
+
+    record_slot *slot = &rec->slots[rec->head % RECORD_QUEUE_SLOTS];
+    const uint32_t *pixels = (const uint32_t *)buffer;
+    for (int y = 0; y < rect.height; y++)
+        memcpy(slot->pixels + (size_t)y*rect.width, pixels + (size_t)(rect.y + y)*width + rect.x, rect.width * 4);
+    slot->rect = rect;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    slot->timestamp_us = (now.tv_sec - rec->start.tv_sec) * 1000000ull
+                       + (now.tv_nsec - rec->start.tv_nsec) / 1000;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->head++;
+    pthread_cond_signal(&rec->ready);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+// Drains the queue, writes the seek index and closes the stream
+void close_recorder(recorder *rec)
+{
+    if (rec->file != NULL) {
+        pthread_mutex_lock(&rec->lock);
+        rec->stopping = 1;
+        pthread_cond_signal(&rec->ready);
+        pthread_mutex_unlock(&rec->lock);
+        pthread_join(rec->thread, NULL);
+
+        // A stream cut short by a failed write stays readable without
+        // the index, like one cut short by a crash
+        if (!rec->failed) {
+            record_file_footer footer = {ftello(rec->file), rec->index_count, 0, RECORD_INDEX_MAGIC};
+            if (fwrite(rec->index, sizeof(record_index_entry), rec->index_count, rec->file) != rec->index_count ||
+                fwrite(&footer, sizeof(footer), 1, rec->file) != 1)
+                fprintf(stderr, "Error writing the recording index: %s\n", strerror(errno));
+        }
+        if (fclose(rec->file))
+            fprintf(stderr, "Error closing recording: %s\n", strerror(errno));
+        rec->file = NULL;
+        printf("Recorded %u frames (%u dropped)\n", rec->frame_count, rec->dropped);
+    }
+    for (int i = 0; i < RECORD_QUEUE_SLOTS; i++)
+        free(rec->slots[i].pixels);
+    free(rec->current);
+    free(rec->previous);
+    free(rec->scratch);
+    free(rec->encoded);
+    free(rec->index);
+    memset(rec, 0, sizeof(recorder));
+}
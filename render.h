@@ -0,0 +1,176 @@
+// Render kernel dispatch
+// The hot loops live in kernels.h, which is compiled once per
+// instruction set level below. The best one the CPU supports is
+// picked at startup, or the one asked for with --kernels
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define KERNEL_CONCAT(name, variant) name##_##variant
+#define KERNEL_NAME(name, variant) KERNEL_CONCAT(name, variant)
+#define KERNEL(name) KERNEL_NAME(name, KERNEL_VARIANT)
+
+// Pixels are stored B, G, R and then 87, which marks them as drawn by us
+KERNEL_INLINE uint32_t pack_color(vec4 color) {
+    color.x = fmin(fmax(color.x, 0), 1);
+    color.y = fmin(fmax(color.y, 0), 1);
+    color.z = fmin(fmax(color.z, 0), 1);
+    return (uint32_t)(unsigned char)(unsigned int)(color.z * 255)
+        | (uint32_t)(unsigned char)(unsigned int)(color.y * 255) << 8
+        | (uint32_t)(unsigned char)(unsigned int)(color.x * 255) << 16
+        | 87u << 24;
+}
+
+KERNEL_INLINE void put_pixel(int x, int y, uint32_t packed, char buffer[], int width) {
+    buffer[(y*width+x)*4] = packed;
+    buffer[(y*width+x)*4+1] = packed >> 8;
+    buffer[(y*width+x)*4+2] = packed >> 16;
+    buffer[(y*width+x)*4+3] = packed >> 24;
+}
+
+KERNEL_INLINE void paint_pixel(int x, int y, vec4 color, char buffer[], int width) {
+    put_pixel(x, y, pack_color(color), buffer, width);
+}
+
+// Paints the downscaled block of the sample at (x, y). Unless
+// RENDER_OVER_TEXT, only over pixels that are black or our own
+KERNEL_INLINE void paint_block(int x, int y, int size, uint32_t color, char buffer[], int width) {
+    for (int dc_offset_x = 0; dc_offset_x < size; dc_offset_x++) {
+        for (int dc_offset_y = 0; dc_offset_y < size; dc_offset_y++) {
+            int x_off = x + dc_offset_x;
+            int y_off = y + dc_offset_y;
+            if (!RENDER_OVER_TEXT) {
+                vec4 fb_color = {buffer[(y_off*width+x_off)*4],
+                    buffer[(y_off*width+x_off)*4+1],
+                    buffer[(y_off*width+x_off)*4+2],
+                    buffer[(y_off*width+x_off)*4+3]};
+                if (!(fb_color.x == 0 && fb_color.y == 0 && fb_color.z == 0) && fb_color.w != 87)
+                    continue;
+            }
+            put_pixel(x_off, y_off, color, buffer, width);
+        }
+    }
+}
+
+// Clears what we painted in the block of the sample at (x, y)
+KERNEL_INLINE void clear_block(int x, int y, int size, char buffer[], int width) {
+    for (int dc_offset_x = 0; dc_offset_x < size; dc_offset_x++) {
+        for (int dc_offset_y = 0; dc_offset_y < size; dc_offset_y++) {
+            int x_off = x + dc_offset_x;
+            int y_off = y + dc_offset_y;
+            if (!RENDER_OVER_TEXT && buffer[(y_off*width+x_off)*4+3] != 87)
+                continue;
+            paint_pixel(x_off, y_off, (vec4){0,0,0,0}, buffer, width);
+        }
+    }
+}
+
+// Ray casts `count` samples on row y, `step` pixels apart from x on,
+// through the fixed point path when it's built in. faces is as for
+// shade_span()
+KERNEL_INLINE void shade_samples(int x, int y, int step, int count, const uniforms *frame,
+    uint32_t colors[], signed char faces[]) {
+#if FIXED_POINT
+    for (int s = 0; s < count; s++) {
+        int front;
+        colors[s] = pack_color_fixed(get_pixel_through_camera_fixed(x + s*step, y, &frame->fixed, &front));
+        if (faces)
+            faces[s] = front;
+    }
+#else
+    vec4 shaded[SPAN_SAMPLES];
+    shade_span(x, y, step, count, frame, shaded, faces);
+    for (int s = 0; s < count; s++)
+        colors[s] = pack_color(shaded[s]);
+#endif
+}
+
+#define KERNEL_VARIANT baseline
+#include "kernels.h"
+#undef KERNEL_VARIANT
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt")
+#define KERNEL_VARIANT sse42
+#include "kernels.h"
+#undef KERNEL_VARIANT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,bmi2")
+#define KERNEL_VARIANT avx2
+#include "kernels.h"
+#undef KERNEL_VARIANT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq,avx512bw,avx512vl,avx2,fma,bmi2")
+#define KERNEL_VARIANT avx512
+#include "kernels.h"
+#undef KERNEL_VARIANT
+#pragma GCC pop_options
+#endif
+
+typedef struct render_kernels
+{
+    const char *name;
+    void (*render_pixels)(char buffer[], int width, int height,
+        vec2 min_coords, vec2 max_coords, int downscaling_factor, const uniforms *frame);
+    void (*render_checkerboard)(char buffer[], int width, int height,
+        vec2 min_coords, vec2 max_coords, int downscaling_factor, const uniforms *frame,
+        sample_history *history);
+    void (*blur)(char pixels[], vec2 min_coords, vec2 max_coords, int width, int height);
+    void (*present)(char *fbp, const char buffer[], int width, int height, int line_length);
+} render_kernels;
+
+#define KERNEL_TABLE(variant, name) \
+    {name, render_pixels_##variant, render_checkerboard_##variant, blur_##variant, present_##variant}
+
+// Best first
+static const render_kernels kernel_variants[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    KERNEL_TABLE(avx512, "avx512"),
+    KERNEL_TABLE(avx2, "avx2"),
+    KERNEL_TABLE(sse42, "sse4.2"),
+#endif
+    KERNEL_TABLE(baseline, "baseline"),
+};
+#define KERNEL_VARIANT_COUNT (int)(sizeof(kernel_variants) / sizeof(render_kernels))
+
+int kernels_supported(const render_kernels *kernels)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (!strcmp(kernels->name, "avx512"))
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+            && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")
+            && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+            && __builtin_cpu_supports("bmi2");
+    if (!strcmp(kernels->name, "avx2"))
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+            && __builtin_cpu_supports("bmi2");
+    if (!strcmp(kernels->name, "sse4.2"))
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+#endif
+    return 1;
+}
+
+// Picks the kernels to render with. requested is a variant name or NULL
+// for the best one this CPU supports. Returns NULL for unknown names
+const render_kernels *select_kernels(const char *requested)
+{
+    for (int i = 0; i < KERNEL_VARIANT_COUNT; i++) {
+        const render_kernels *kernels = &kernel_variants[i];
+        if (requested == NULL) {
+            if (kernels_supported(kernels))
+                return kernels;
+        } else if (!strcmp(requested, kernels->name)) {
+            if (!kernels_supported(kernels))
+                fprintf(stderr, "Warning: this CPU does not support the %s kernels\n", kernels->name);
+            return kernels;
+        }
+    }
+    return NULL;
+}
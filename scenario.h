@@ -0,0 +1,340 @@
+// Scripted scenarios
+// A scenario drives the cube for a fixed number of frames with a fixed
+// time step, so runs are comparable no matter how fast frames render.
+// It's a text file, one directive per line, '#' starts a comment:
+//
+//   frames <count>                   Number of frames to run
+//   delta <seconds>                  Simulated time per frame
+//   step <frame> <seconds>           Simulated time per frame from that
+//                                    frame on, overriding delta
+//   downscaling <factor>             Overrides DOWNSCALING_FACTOR
+//   key <frame> <track> <values...>  Keyframe, linearly interpolated:
+//       time <t>                     cube time
+//       camera_position <x> <y> <z>
+//       camera_rotation <x> <y> <z>
+//       light_position <x> <y> <z>   the first light in LIGHTS
+//   input <frame> <keys>             Keys held from that frame on, as
+//                                    in KeyState: wasdhjkl, ' ' written
+//                                    as _, shift as ^, - for none
+//
+// Tracks without keyframes are left alone, so a scenario can be a pure
+// input trace (what --record-input writes, with the step of every live
+// frame so it moves exactly as recorded), pure camera paths, or a mix
+
+#define SCENARIO_MAX_KEYS 1024
+#define SCENARIO_MAX_INPUTS 4096
+#define SCENARIO_TRACKS 4
+#define SCENARIO_TOLERANCE 0.10 // Allowed slowdown over the baseline, per percentile
+
+enum { TRACK_TIME, TRACK_CAMERA_POSITION, TRACK_CAMERA_ROTATION, TRACK_LIGHT_POSITION };
+static const char *scenario_track_names[SCENARIO_TRACKS] = {
+    "time", "camera_position", "camera_rotation", "light_position"
+};
+
+typedef struct scenario_key
+{
+    int frame;
+    vec3 value; // Only x is used by the time track
+} scenario_key;
+
+typedef struct scenario_input
+{
+    int frame;
+    KeyState keys;
+} scenario_input;
+
+typedef struct scenario_step
+{
+    int frame;
+    double delta;
+} scenario_step;
+
+typedef struct scenario
+{
+    int frame_count;
+    double delta;
+    int downscaling; // 0 when not overridden
+
+    scenario_key keys[SCENARIO_TRACKS][SCENARIO_MAX_KEYS];
+    int key_count[SCENARIO_TRACKS];
+    scenario_input inputs[SCENARIO_MAX_INPUTS];
+    int input_count;
+    scenario_step *steps; // One per live frame for recorded input, so grown as needed
+    int step_count, step_capacity;
+
+    int frame; // Current frame while replaying
+    unsigned int *frame_times_us;
+} scenario;
+
+KeyState scenario_parse_keys(const char *text)
+{
+    KeyState keys = {0};
+    for (; *text; text++) {
+        switch (*text) {
+            case 'w': keys.w = 1; break;
+            case 'a': keys.a = 1; break;
+            case 's': keys.s = 1; break;
+            case 'd': keys.d = 1; break;
+            case 'h': keys.h = 1; break;
+            case 'j': keys.j = 1; break;
+            case 'k': keys.k = 1; break;
+            case 'l': keys.l = 1; break;
+            case '_': keys.space = 1; break;
+            case '^': keys.shift = 1; break;
+        }
+    }
+    return keys;
+}
+
+void scenario_format_keys(KeyState keys, char text[16])
+{
+    int length = 0;
+    if (keys.w) text[length++] = 'w';
+    if (keys.a) text[length++] = 'a';
+    if (keys.s) text[length++] = 's';
+    if (keys.d) text[length++] = 'd';
+    if (keys.h) text[length++] = 'h';
+    if (keys.j) text[length++] = 'j';
+    if (keys.k) text[length++] = 'k';
+    if (keys.l) text[length++] = 'l';
+    if (keys.space) text[length++] = '_';
+    if (keys.shift) text[length++] = '^';
+    if (length == 0) text[length++] = '-';
+    text[length] = 0;
+}
+
+int load_scenario(scenario *scene, const char *path)
+{
+    memset(scene, 0, sizeof(scenario));
+    scene->delta = FRAME_LIMIT > 0 ? 1.0 / FRAME_LIMIT : 1.0 / 60;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening scenario '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = 0;
+
+        char directive[32], track[32], keys[32];
+        int frame;
+        vec3 value = {0, 0, 0};
+        int parsed = 1;
+        if (sscanf(line, " %31s", directive) != 1) {
+            continue;
+        } else if (!strcmp(directive, "frames")) {
+            parsed = sscanf(line, " frames %d", &scene->frame_count) == 1;
+        } else if (!strcmp(directive, "delta")) {
+            parsed = sscanf(line, " delta %lf", &scene->delta) == 1;
+        } else if (!strcmp(directive, "step")) {
+            double delta;
+            parsed = sscanf(line, " step %d %lf", &frame, &delta) == 2 && delta >= 0;
+            if (parsed && scene->step_count == scene->step_capacity) {
+                int capacity = scene->step_capacity ? scene->step_capacity * 2 : 1024;
+                scenario_step *grown = realloc(scene->steps, capacity * sizeof(scenario_step));
+                parsed = grown != NULL;
+                if (parsed) {
+                    scene->steps = grown;
+                    scene->step_capacity = capacity;
+                }
+            }
+            if (parsed)
+                scene->steps[scene->step_count++] = (scenario_step){frame, delta};
+        } else if (!strcmp(directive, "downscaling")) {
+            parsed = sscanf(line, " downscaling %d", &scene->downscaling) == 1 && scene->downscaling > 0;
+        } else if (!strcmp(directive, "key")) {
+            int values = sscanf(line, " key %d %31s %lf %lf %lf", &frame, track, &value.x, &value.y, &value.z);
+            int t = 0;
+            while (t < SCENARIO_TRACKS && strcmp(track, scenario_track_names[t]))
+                t++;
+            parsed = t < SCENARIO_TRACKS && values == (t == TRACK_TIME ? 3 : 5)
+                && scene->key_count[t] < SCENARIO_MAX_KEYS;
+            if (parsed)
+                scene->keys[t][scene->key_count[t]++] = (scenario_key){frame, value};
+        } else if (!strcmp(directive, "input")) {
+            parsed = sscanf(line, " input %d %31s", &frame, keys) == 2 && scene->input_count < SCENARIO_MAX_INPUTS;
+            if (parsed)
+                scene->inputs[scene->input_count++] = (scenario_input){frame, scenario_parse_keys(keys)};
+        } else {
+            parsed = 0;
+        }
+        if (!parsed) {
+            fprintf(stderr, "%s:%d: invalid scenario line\n", path, line_number);
+            fclose(file);
+            free(scene->steps);
+            return 0;
+        }
+    }
+    fclose(file);
+
+    if (scene->frame_count <= 0 || scene->delta <= 0) {
+        fprintf(stderr, "%s: scenario needs a positive frame count and delta\n", path);
+        free(scene->steps);
+        return 0;
+    }
+    scene->frame_times_us = calloc(scene->frame_count, sizeof(unsigned int));
+    return scene->frame_times_us != NULL;
+}
+
+// Interpolates a track at a frame. Returns 0 if the track has no keys.
+// Keys are expected in frame order
+int scenario_track_value(const scenario *scene, int track, int frame, vec3 *value)
+{
+    int count = scene->key_count[track];
+    const scenario_key *keys = scene->keys[track];
+    if (count == 0)
+        return 0;
+    if (frame <= keys[0].frame) {
+        *value = keys[0].value;
+        return 1;
+    }
+    for (int i = 1; i < count; i++) {
+        if (frame <= keys[i].frame) {
+            double span = keys[i].frame - keys[i-1].frame;
+            double progress = span > 0 ? (frame - keys[i-1].frame) / span : 1;
+            *value = add_vec3(keys[i-1].value,
+                scale_vec3(subtract_vec3(keys[i].value, keys[i-1].value), progress));
+            return 1;
+        }
+    }
+    *value = keys[count - 1].value;
+    return 1;
+}
+
+// Simulated time for a frame, from the last step at or before it.
+// Steps are expected in frame order
+double scenario_delta(const scenario *scene, int frame)
+{
+    int low = 0, high = scene->step_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (scene->steps[middle].frame <= frame)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low > 0 ? scene->steps[low - 1].delta : scene->delta;
+}
+
+// Keys held at a frame, per the input trace
+KeyState scenario_keys(const scenario *scene, int frame)
+{
+    KeyState keys = {0};
+    for (int i = 0; i < scene->input_count && scene->inputs[i].frame <= frame; i++)
+        keys = scene->inputs[i].keys;
+    return keys;
+}
+
+int compare_unsigned(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct scenario_stats
+{
+    double mean_us;
+    unsigned int p50_us, p95_us, p99_us, max_us;
+} scenario_stats;
+
+// Nearest rank percentiles over the frames that ran
+scenario_stats scenario_statistics(const scenario *scene, int frames)
+{
+    scenario_stats stats = {0};
+    if (frames <= 0)
+        return stats;
+    unsigned int *sorted = malloc(frames * sizeof(unsigned int));
+    if (sorted == NULL)
+        return stats;
+    memcpy(sorted, scene->frame_times_us, frames * sizeof(unsigned int));
+    qsort(sorted, frames, sizeof(unsigned int), compare_unsigned);
+
+    double total = 0;
+    for (int i = 0; i < frames; i++)
+        total += sorted[i];
+    stats.mean_us = total / frames;
+    stats.p50_us = sorted[(int)ceil(0.50 * frames) - 1];
+    stats.p95_us = sorted[(int)ceil(0.95 * frames) - 1];
+    stats.p99_us = sorted[(int)ceil(0.99 * frames) - 1];
+    stats.max_us = sorted[frames - 1];
+    free(sorted);
+    return stats;
+}
+
+// Writes the frame time report as JSON. Histogram buckets double in
+// size, each counts frames up to and including its bound
+void write_scenario_report(FILE *file, const scenario *scene, int frames, scenario_stats stats)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"frames\": %d,\n", frames);
+    fprintf(file, "  \"delta\": %f,\n", scene->delta);
+    fprintf(file, "  \"mean_us\": %.1f,\n", stats.mean_us);
+    fprintf(file, "  \"p50_us\": %u,\n", stats.p50_us);
+    fprintf(file, "  \"p95_us\": %u,\n", stats.p95_us);
+    fprintf(file, "  \"p99_us\": %u,\n", stats.p99_us);
+    fprintf(file, "  \"max_us\": %u,\n", stats.max_us);
+    fprintf(file, "  \"histogram\": [");
+    unsigned int bound = 125;
+    int counted = 0;
+    for (int bucket = 0; counted < frames; bucket++, bound *= 2) {
+        int count = 0;
+        for (int i = 0; i < frames; i++) {
+            unsigned int t = scene->frame_times_us[i];
+            if (t <= bound && (bucket == 0 || t > bound / 2))
+                count++;
+        }
+        counted += count;
+        fprintf(file, "%s\n    {\"le_us\": %u, \"count\": %d}", bucket ? "," : "", bound, count);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// Reads "name": value out of a report written by write_scenario_report()
+int scenario_report_value(const char *report, const char *name, double *value)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *found = strstr(report, key);
+    if (found == NULL)
+        return 0;
+    *value = strtod(found + strlen(key), NULL);
+    return 1;
+}
+
+// Compares against a stored report. Returns 0 if any percentile is more
+// than SCENARIO_TOLERANCE slower than the baseline
+int compare_scenario_baseline(const char *path, scenario_stats stats, FILE *out)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening baseline '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    char report[8192];
+    size_t length = fread(report, 1, sizeof(report) - 1, file);
+    report[length] = 0;
+    fclose(file);
+
+    const char *names[] = {"p50_us", "p95_us", "p99_us"};
+    unsigned int values[] = {stats.p50_us, stats.p95_us, stats.p99_us};
+    int passed = 1;
+    for (int i = 0; i < 3; i++) {
+        double baseline;
+        if (!scenario_report_value(report, names[i], &baseline) || baseline <= 0) {
+            fprintf(stderr, "Baseline '%s' has no %s\n", path, names[i]);
+            return 0;
+        }
+        double ratio = values[i] / baseline;
+        int regressed = ratio > 1 + SCENARIO_TOLERANCE;
+        fprintf(out, "%s: %u us vs %.0f us baseline (%+.1f%%)%s\n", names[i], values[i],
+            baseline, (ratio - 1) * 100, regressed ? " REGRESSION" : "");
+        if (regressed)
+            passed = 0;
+    }
+    return passed;
+}
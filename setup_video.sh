@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+
+[[ -z $2 ]] && echo "Usage: ./setup_video.sh <path_to_clip> <output.ttcv> [size] [fps]" && exit
+
+script_dir="$( cd -- "$( dirname -- "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )"
+clip="$1"
+output="$2"
+size="${3:-256}"
+fps="${4:-25}"
+
+# Faces are square, so the clip is too. Every face keeps VIDEO_PREFETCH + 1
+# frames of size x size decoded, keep it small
+ffmpeg -loglevel error -i "$clip" -vf "scale=$size:$size,fps=$fps" -f rawvideo -pix_fmt bgra - \
+    | python "$script_dir/video_to_binary_data.py" $size $size $fps "$output"
+
+echo "Done. Add '$output' to VIDEO_FACES in config.h and set SHADER to video"
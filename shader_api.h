@@ -0,0 +1,57 @@
+// Span shader ABI
+// This is all a shader needs to include, built in or not. Shaders get
+// a whole span of fragments (every face hit by a run of rays on one
+// screen row) as plain arrays and fill in their colors, so there's one
+// call per span instead of one per pixel and the loops are the
+// shader's own to vectorize.
+//
+// A shader plugin is a shared object exporting a span_shader named
+// tty_cube_shader:
+//
+//   #include "shader_api.h"
+//   static void shade(const shader_uniforms *uniforms, const fragment_span *span) { ... }
+//   const span_shader tty_cube_shader = {SHADER_ABI_VERSION, "my_shader", shade};
+//
+// Build it with: gcc -shared -fPIC -O3 my_shader.c -o my_shader.so
+// and run with: ./tty_cube --shader ./my_shader.so
+// See shaders/ for an example.
+//
+// SHADER_ABI_VERSION goes up whenever anything below changes in a way
+// that breaks already built shaders. Mismatching shaders aren't loaded
+
+#include <stdint.h>
+
+#define SHADER_ABI_VERSION 1
+
+// Same for every span of a frame
+typedef struct shader_uniforms
+{
+    float time;
+    float resolution[2]; // Face size in pixels, u and v go from 0 to these
+} shader_uniforms;
+
+typedef struct fragment_span
+{
+    int count;
+
+    // Input, one entry per fragment
+    const float *u; // Position on the face, in pixels
+    const float *v;
+    const int32_t *face; // Which face was hit, 0 to 5
+
+    // Output, one entry per fragment, 0 to 1 each.
+    // Alpha blends the faces behind when SHADING is off
+    float *r;
+    float *g;
+    float *b;
+    float *a;
+} fragment_span;
+
+typedef void (*shade_span_function)(const shader_uniforms *uniforms, const fragment_span *span);
+
+typedef struct span_shader
+{
+    uint32_t abi_version; // Always SHADER_ABI_VERSION
+    const char *name;
+    shade_span_function shade;
+} span_shader;
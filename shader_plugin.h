@@ -0,0 +1,155 @@
+// Span shaders loaded from shared objects, see shader_api.h
+// dlopen() hands back the object it already has for a path it knows,
+// so every load opens a fresh copy of the file instead. The copy is
+// unlinked right away, the mapping outlives it. It goes to the first of
+// $XDG_RUNTIME_DIR, the plugin's own directory and /tmp that takes it,
+// /tmp alone fails where it is mounted noexec.
+// With SHADER_HOT_RELOAD the file is checked about once a second and a
+// changed shader is swapped in between frames. A build that doesn't
+// load leaves the previous shader running
+
+typedef struct shader_plugin
+{
+    const char *path;
+    void *handle;
+    const span_shader *shader;
+    struct timespec modified; // Of the file last loaded (or tried)
+    struct timespec checked;
+} shader_plugin;
+
+const span_shader *find_builtin_shader(const char *name)
+{
+    for (int i = 0; i < BUILTIN_SHADER_COUNT; i++) {
+        if (!strcmp(builtin_shaders[i]->name, name))
+            return builtin_shaders[i];
+    }
+    return NULL;
+}
+
+// Shader arguments with a slash in them are files: ./plasma.so
+int is_shader_path(const char *name)
+{
+    return strchr(name, '/') != NULL;
+}
+
+int copy_file(const char *from, int to)
+{
+    int source = open(from, O_RDONLY);
+    if (source < 0)
+        return 0;
+    char data[65536];
+    ssize_t length;
+    while ((length = read(source, data, sizeof(data))) > 0) {
+        if (write(to, data, length) != length) {
+            close(source);
+            return 0;
+        }
+    }
+    close(source);
+    return length == 0;
+}
+
+// Copies path into dir and opens the copy. On failure the reason is
+// left in error
+void *open_shader_copy(const char *dir, int dir_length, const char *path, char *error, size_t error_size)
+{
+    char copy[4096];
+    if (snprintf(copy, sizeof(copy), "%.*s/.tty_cube_shader.XXXXXX", dir_length, dir) >= (int)sizeof(copy)) {
+        snprintf(error, error_size, "%s", strerror(ENAMETOOLONG));
+        return NULL;
+    }
+    int fd = mkstemp(copy);
+    if (fd < 0) {
+        snprintf(error, error_size, "copy in %.*s: %s", dir_length, dir, strerror(errno));
+        return NULL;
+    }
+    int copied = copy_file(path, fd);
+    if (!copied)
+        snprintf(error, error_size, "copy in %.*s: %s", dir_length, dir, strerror(errno));
+    close(fd);
+    void *handle = copied ? dlopen(copy, RTLD_NOW | RTLD_LOCAL) : NULL;
+    if (copied && handle == NULL)
+        snprintf(error, error_size, "%s", dlerror());
+    unlink(copy);
+    return handle;
+}
+
+// Loads plugin->path, replacing the loaded shader only on success
+int load_shader_plugin(shader_plugin *plugin)
+{
+    struct stat info;
+    if (stat(plugin->path, &info)) {
+        fprintf(stderr, "Error opening shader '%s': %s\n", plugin->path, strerror(errno));
+        return 0;
+    }
+    plugin->modified = info.st_mtim;
+
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    const char *plugin_dir = plugin->path;
+    int plugin_dir_length = strrchr(plugin->path, '/') - plugin->path;
+    if (plugin_dir_length == 0) {
+        plugin_dir = "/";
+        plugin_dir_length = 1;
+    }
+    char error[512] = "";
+    void *handle = NULL;
+    if (runtime_dir != NULL && runtime_dir[0] != '\0')
+        handle = open_shader_copy(runtime_dir, strlen(runtime_dir), plugin->path, error, sizeof(error));
+    if (handle == NULL)
+        handle = open_shader_copy(plugin_dir, plugin_dir_length, plugin->path, error, sizeof(error));
+    if (handle == NULL)
+        handle = open_shader_copy("/tmp", 4, plugin->path, error, sizeof(error));
+    if (handle == NULL) {
+        fprintf(stderr, "Error loading shader '%s': %s\n", plugin->path, error);
+        return 0;
+    }
+
+    const span_shader *shader = dlsym(handle, "tty_cube_shader");
+    if (shader == NULL) {
+        fprintf(stderr, "'%s' has no tty_cube_shader, see shader_api.h\n", plugin->path);
+        dlclose(handle);
+        return 0;
+    }
+    if (shader->abi_version != SHADER_ABI_VERSION) {
+        fprintf(stderr, "'%s' was built for shader ABI %u, this is %u\n",
+            plugin->path, shader->abi_version, SHADER_ABI_VERSION);
+        dlclose(handle);
+        return 0;
+    }
+    if (shader->shade == NULL) {
+        fprintf(stderr, "'%s' has no shade function\n", plugin->path);
+        dlclose(handle);
+        return 0;
+    }
+
+    if (plugin->handle)
+        dlclose(plugin->handle);
+    plugin->handle = handle;
+    plugin->shader = shader;
+    return 1;
+}
+
+// Nothing may be shading while this runs. Returns 1 if a changed
+// shader was loaded
+int reload_shader_plugin(shader_plugin *plugin)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - plugin->checked.tv_sec < 1)
+        return 0;
+    plugin->checked = now;
+
+    struct stat info;
+    if (stat(plugin->path, &info) ||
+        (info.st_mtim.tv_sec == plugin->modified.tv_sec && info.st_mtim.tv_nsec == plugin->modified.tv_nsec))
+        return 0;
+    return load_shader_plugin(plugin);
+}
+
+void close_shader_plugin(shader_plugin *plugin)
+{
+    if (plugin->handle)
+        dlclose(plugin->handle);
+    plugin->handle = NULL;
+    plugin->shader = NULL;
+}
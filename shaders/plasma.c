@@ -0,0 +1,25 @@
+// Example shader plugin, an animated plasma
+// Build: make shaders
+// Run:   ./tty_cube --shader ./shaders/plasma.so
+// Edit and rebuild while it runs to see it reload
+#include <math.h>
+#include "../shader_api.h"
+
+static void shade(const shader_uniforms *uniforms, const fragment_span *span)
+{
+    float time = uniforms->time / 100;
+    float scale = 12 / uniforms->resolution[0];
+
+    // Plain loops over plain arrays, the compiler vectorizes these
+    for (int i = 0; i < span->count; i++) {
+        float x = span->u[i] * scale;
+        float y = span->v[i] * scale;
+        float value = sinf(x + time) + sinf(y - time) + sinf(x + y + span->face[i]);
+        span->r[i] = 0.5f + 0.5f * sinf(value);
+        span->g[i] = 0.5f + 0.5f * sinf(value + 2.094f);
+        span->b[i] = 0.5f + 0.5f * sinf(value + 4.189f);
+        span->a[i] = 0.8f;
+    }
+}
+
+const span_shader tty_cube_shader = {SHADER_ABI_VERSION, "plasma", shade};
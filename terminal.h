@@ -0,0 +1,306 @@
+// ANSI truecolor terminal output
+// Every character cell shows two vertically stacked pixels using the
+// upper half block glyph: foreground is the top pixel, background the
+// bottom one. Frames are diffed against what the terminal already shows
+// and only changed cells are sent, in a single write() per frame
+
+#define TERMINAL_UNSET_COLOR 0xFFFFFFFFu
+
+typedef struct terminal_output
+{
+    int columns;
+    int rows;
+
+    // Colors currently on screen for each cell, 0xRRGGBB
+    unsigned int *top;
+    unsigned int *bottom;
+
+    // Output for one frame
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed; // data couldn't grow, the frame is incomplete
+    int warned;
+
+    // Terminal state while emitting, so runs of cells reuse it
+    int cursor_x;
+    int cursor_y;
+    unsigned int foreground;
+    unsigned int background;
+
+    struct termios saved_termios;
+    int termios_saved;
+} terminal_output;
+
+volatile sig_atomic_t terminal_resized = 0;
+terminal_output *active_terminal = NULL;
+
+void terminal_winch(int signum) { terminal_resized = 1; }
+
+// Returns 0 once the output can't grow. Everything appended after that
+// is dropped too, terminal_present() then skips the frame
+int terminal_append(terminal_output *term, const char *data, size_t length)
+{
+    if (term->failed)
+        return 0;
+    if (term->length + length > term->capacity) {
+        size_t capacity = term->capacity ? term->capacity : 4096;
+        while (term->length + length > capacity)
+            capacity *= 2;
+        char *grown = realloc(term->data, capacity);
+        if (grown == NULL) {
+            term->failed = 1;
+            return 0;
+        }
+        term->data = grown;
+        term->capacity = capacity;
+    }
+    memcpy(term->data + term->length, data, length);
+    term->length += length;
+    return 1;
+}
+
+int terminal_append_string(terminal_output *term, const char *string)
+{
+    return terminal_append(term, string, strlen(string));
+}
+
+// Writes everything out, retrying on partial writes
+void terminal_flush(terminal_output *term)
+{
+    size_t written = 0;
+    while (written < term->length) {
+        ssize_t rc = write(STDOUT_FILENO, term->data + written, term->length - written);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        written += rc;
+    }
+    term->length = 0;
+}
+
+// Considers every cell and the cursor unknown, so the next frame
+// sends all of them
+void terminal_forget_screen(terminal_output *term)
+{
+    size_t cells = (size_t)term->columns * term->rows;
+    for (size_t i = 0; i < cells; i++) {
+        term->top[i] = TERMINAL_UNSET_COLOR;
+        term->bottom[i] = TERMINAL_UNSET_COLOR;
+    }
+    term->foreground = TERMINAL_UNSET_COLOR;
+    term->background = TERMINAL_UNSET_COLOR;
+    term->cursor_x = -1;
+    term->cursor_y = -1;
+}
+
+// Queries the terminal size and (re)allocates the cell state.
+// Everything on screen is considered stale afterwards
+int terminal_resize(terminal_output *term)
+{
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) || size.ws_col == 0 || size.ws_row == 0) {
+        size.ws_col = 80;
+        size.ws_row = 24;
+    }
+    term->columns = size.ws_col;
+    term->rows = size.ws_row;
+
+    size_t cells = (size_t)term->columns * term->rows;
+    free(term->top);
+    free(term->bottom);
+    term->top = malloc(cells * sizeof(unsigned int));
+    term->bottom = malloc(cells * sizeof(unsigned int));
+    if (term->top == NULL || term->bottom == NULL)
+        return 0;
+    terminal_forget_screen(term);
+    terminal_append_string(term, "\x1b[0m\x1b[2J");
+    return 1;
+}
+
+void cleanup_terminal()
+{
+    terminal_output *term = active_terminal;
+    if (term == NULL)
+        return;
+    active_terminal = NULL;
+
+    // Reset colors, show the cursor and leave the alternate screen
+    terminal_append_string(term, "\x1b[0m\x1b[?25h\x1b[?1049l");
+    terminal_flush(term);
+    if (term->termios_saved)
+        tcsetattr(STDIN_FILENO, TCSANOW, &term->saved_termios);
+
+    free(term->top);
+    free(term->bottom);
+    free(term->data);
+}
+
+int setup_terminal(terminal_output *term)
+{
+    memset(term, 0, sizeof(terminal_output));
+
+    // Don't echo keys typed while the cube is on screen
+    if (tcgetattr(STDIN_FILENO, &term->saved_termios) == 0) {
+        struct termios raw = term->saved_termios;
+        raw.c_lflag &= ~(ECHO | ICANON);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        term->termios_saved = 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = terminal_winch;
+    sigaction(SIGWINCH, &action, NULL);
+
+    // Alternate screen, hidden cursor
+    terminal_append_string(term, "\x1b[?1049h\x1b[?25l");
+    active_terminal = term;
+    atexit(cleanup_terminal);
+    return terminal_resize(term);
+}
+
+void terminal_append_number(terminal_output *term, unsigned int value)
+{
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    char text[10];
+    for (int i = 0; i < count; i++)
+        text[i] = digits[count - 1 - i];
+    terminal_append(term, text, count);
+}
+
+void terminal_append_color(terminal_output *term, unsigned int color)
+{
+    terminal_append_number(term, (color >> 16) & 0xFF);
+    terminal_append(term, ";", 1);
+    terminal_append_number(term, (color >> 8) & 0xFF);
+    terminal_append(term, ";", 1);
+    terminal_append_number(term, color & 0xFF);
+}
+
+// Emits a single SGR sequence for whichever colors actually change
+void terminal_set_colors(terminal_output *term, unsigned int foreground, unsigned int background)
+{
+    int set_foreground = foreground != TERMINAL_UNSET_COLOR && foreground != term->foreground;
+    int set_background = background != TERMINAL_UNSET_COLOR && background != term->background;
+    if (!set_foreground && !set_background)
+        return;
+
+    terminal_append(term, "\x1b[", 2);
+    if (set_foreground) {
+        terminal_append(term, "38;2;", 5);
+        terminal_append_color(term, foreground);
+        term->foreground = foreground;
+    }
+    if (set_background) {
+        if (set_foreground)
+            terminal_append(term, ";", 1);
+        terminal_append(term, "48;2;", 5);
+        terminal_append_color(term, background);
+        term->background = background;
+    }
+    terminal_append(term, "m", 1);
+}
+
+// Moves the cursor with whichever sequence is shortest
+void terminal_move_cursor(terminal_output *term, int x, int y)
+{
+    if (term->cursor_x == x && term->cursor_y == y)
+        return;
+    if (term->cursor_y == y && term->cursor_x >= 0 && x > term->cursor_x) {
+        int skip = x - term->cursor_x;
+        terminal_append(term, "\x1b[", 2);
+        if (skip > 1)
+            terminal_append_number(term, skip);
+        terminal_append(term, "C", 1);
+    } else {
+        terminal_append(term, "\x1b[", 2);
+        terminal_append_number(term, y + 1);
+        terminal_append(term, ";", 1);
+        terminal_append_number(term, x + 1);
+        terminal_append(term, "H", 1);
+    }
+    term->cursor_x = x;
+    term->cursor_y = y;
+}
+
+unsigned int terminal_pixel(const char buffer[], int x, int y, int width)
+{
+    const unsigned char *pixel = (const unsigned char *)&buffer[(y*width + x)*4];
+    // Buffer is BGRA like the framebuffer
+    return (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+}
+
+// Sends the cells of buffer (width x height pixels, height = 2 * rows)
+// that differ from what is on screen. Returns 0 if the frame had to be
+// skipped
+int terminal_present(terminal_output *term, const char buffer[], int width, int height)
+{
+    static const char upper_half[] = "\xe2\x96\x80"; // ▀
+    static const char lower_half[] = "\xe2\x96\x84"; // ▄
+
+    for (int row = 0; row < term->rows; row++) {
+        for (int column = 0; column < term->columns; column++) {
+            int cell = row * term->columns + column;
+            unsigned int top = 0, bottom = 0;
+            if (column < width && 2*row < height)
+                top = terminal_pixel(buffer, column, 2*row, width);
+            if (column < width && 2*row + 1 < height)
+                bottom = terminal_pixel(buffer, column, 2*row + 1, width);
+
+            if (top == term->top[cell] && bottom == term->bottom[cell])
+                continue;
+            term->top[cell] = top;
+            term->bottom[cell] = bottom;
+
+            terminal_move_cursor(term, column, row);
+            if (top == bottom) {
+                // One color, reuse whichever one is already set
+                if (term->foreground == top && term->background != top) {
+                    terminal_append(term, "\xe2\x96\x88", 3); // █
+                } else {
+                    terminal_set_colors(term, TERMINAL_UNSET_COLOR, top);
+                    terminal_append(term, " ", 1);
+                }
+            } else {
+                // Pick the glyph needing the fewest color changes
+                int upper_changes = (term->foreground != top) + (term->background != bottom);
+                int lower_changes = (term->foreground != bottom) + (term->background != top);
+                if (lower_changes < upper_changes) {
+                    terminal_set_colors(term, bottom, top);
+                    terminal_append(term, lower_half, 3);
+                } else {
+                    terminal_set_colors(term, top, bottom);
+                    terminal_append(term, upper_half, 3);
+                }
+            }
+            term->cursor_x++;
+
+            // Terminals may wrap or hold the cursor at the last column,
+            // don't guess where it ended up
+            if (term->cursor_x >= term->columns)
+                term->cursor_x = -1;
+        }
+    }
+
+    // Half a frame would leave the screen out of sync with top and
+    // bottom, drop it and redraw everything next time
+    if (term->failed) {
+        if (!term->warned)
+            fprintf(stderr, "Out of memory for terminal output, skipping frames\n");
+        term->warned = 1;
+        term->failed = 0;
+        term->length = 0;
+        terminal_forget_screen(term);
+        return 0;
+    }
+    terminal_flush(term);
+    return 1;
+}
@@ -12,13 +12,33 @@
 #include <time.h>
 #include <termios.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
 #include "config.h"
 #include "vectors.h"
+#include "shader_api.h"
 #include "fragment_shaders.h"
 #include "light.h"
+#include "fixed.h"
 #include "camera.h"
 #include "blur.h"
+#include "checkerboard.h"
+#include "render.h"
+#include "buffer.h"
+#include "perf.h"
+#include "outputs.h"
+#include "shader_plugin.h"
+#include "terminal.h"
+#include "record.h"
+#include "export.h"
+#ifdef VIDEO_FACES
+#include "video.h"
+#endif
 
 #define PI 3.14159265
 #define EPSILON 1e-6f
@@ -33,6 +53,8 @@ typedef struct {
     int space;
 } KeyState;
 
+#include "scenario.h"
+
 KeyState key_state = {0};
 struct libevdev *input_dev = NULL;
 int input_fd = -1;
@@ -74,13 +96,18 @@ int setup_input(const char *device_path) {
 
 void term(int signum) { done = 1; }
 
-void process_input_events() {
+// Returns the number of key events read
+int process_input_events() {
+    if (input_dev == NULL)
+        return 0;
     struct input_event ev;
     int rc;
+    int events = 0;
     do {
         rc = libevdev_next_event(input_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
         if (rc == 0 && ev.type == EV_KEY) {
             int pressed = ev.value != 0;
+            events++;
             switch (ev.code) {
                 case KEY_W: key_state.w = pressed; break;
                 case KEY_A: key_state.a = pressed; break;
@@ -97,76 +124,461 @@ void process_input_events() {
             }
         }
     } while (rc == 1 || rc == 0);
+    return events;
+}
+
+// Sleeps until the input device has events, a signal arrives (SIGINT,
+// SIGWINCH) or timeout_ms passes. -1 waits for as long as it takes
+void wait_for_input(int timeout_ms) {
+    struct pollfd input = {input_fd, POLLIN, 0};
+    poll(&input, input_fd >= 0, timeout_ms);
+}
+
+// What every output draws this frame
+typedef struct frame_state
+{
+    render_kernels kernels;
+    const span_shader *shader;
+    int downscaling_factor;
+    terminal_output *terminal; // NULL unless TERMINAL_OUTPUT
+
+    double time;
+    vec3 camera_position;
+    vec3 camera_rotation;
+    light3 lights[MAX_LIGHTS];
+    int light_count;
+} frame_state;
+
+// Renders and presents one output. Runs on that output's thread
+void draw_output(output *out, void *context) {
+    const frame_state *state = context;
+
+    // Terminals have few pixels, scale the view so the cube takes
+    // the same share of it as on a TERMINAL_SCALE lines tall screen
+    double view_scale = TERMINAL_OUTPUT ? (double)TERMINAL_SCALE / out->vinfo.yres : 1;
+
+    // Camera setup
+    camera cam = (camera){-SIDE_LENGTH,
+        state->time,
+        (vec2){out->vinfo.xres, out->vinfo.yres},
+        state->camera_rotation,
+        state->camera_position,
+        (vec3){view_scale,view_scale,1},
+        (vec2){0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0},
+        (vec3){0,0,0}
+    };
+    camera transformed_cam = setup_camera(cam);
+
+    // Each screen shows its own part of the shared view plane
+    transformed_cam.center_offset.x -= out->config.x;
+    transformed_cam.center_offset.y -= out->config.y;
+
+    // Cube transform, any rotation matrix works here
+    mat3 cube_rotation = rotation_mat3_y(transformed_cam.time*4*PI/1000);
+    mat4 cube_transform = affine_mat4(cube_rotation, (vec3){0, 0, 0});
+
+    // Per-frame constants for the per-pixel code
+    uniforms frame = setup_uniforms(transformed_cam, state->lights, state->light_count, cube_transform, state->shader);
+
+    // Bounding box for cube
+    vec3 vertices[8] = {
+        (vec3){SIDE_LENGTH/2, SIDE_LENGTH/2, SIDE_LENGTH/2},
+        (vec3){SIDE_LENGTH/2, SIDE_LENGTH/2, -SIDE_LENGTH/2},
+        (vec3){SIDE_LENGTH/2, -SIDE_LENGTH/2, SIDE_LENGTH/2},
+        (vec3){SIDE_LENGTH/2, -SIDE_LENGTH/2, -SIDE_LENGTH/2},
+        (vec3){-SIDE_LENGTH/2, SIDE_LENGTH/2, SIDE_LENGTH/2},
+        (vec3){-SIDE_LENGTH/2, SIDE_LENGTH/2, -SIDE_LENGTH/2},
+        (vec3){-SIDE_LENGTH/2, -SIDE_LENGTH/2, SIDE_LENGTH/2},
+        (vec3){-SIDE_LENGTH/2, -SIDE_LENGTH/2, -SIDE_LENGTH/2}
+    };
+
+    for (int i = 0; i < 8; i++) {
+        vertices[i] = transform_point_mat4(frame.cube_to_world, vertices[i]);
+    }
+
+    vec2 min_coords = {INFINITY, INFINITY};
+    vec2 max_coords = {-INFINITY, -INFINITY};
+
+    for (int i = 0; i < 8; i++) {
+        vec2 screen = project_vertex_to_screen(vertices[i], transformed_cam);
+        if (screen.x < min_coords.x) min_coords.x = screen.x;
+        if (screen.y < min_coords.y) min_coords.y = screen.y;
+        if (screen.x > max_coords.x) max_coords.x = screen.x;
+        if (screen.y > max_coords.y) max_coords.y = screen.y;
+    }
+
+    // Clamp to screen
+    min_coords.x = fmax(0, min_coords.x);
+    min_coords.y = fmax(0, min_coords.y);
+    max_coords.x = fmin(out->vinfo.xres-1, max_coords.x);
+    max_coords.y = fmin(out->vinfo.yres-1, max_coords.y);
+
+    // The cube may miss this screen entirely, then the kernels only clear
+    // the last frame. (int) truncates towards 0, so an empty box is
+    // stored as one that stays empty after the casts
+    int box_empty = min_coords.x > max_coords.x || min_coords.y > max_coords.y;
+    if (box_empty) {
+        min_coords = (vec2){1, 1};
+        max_coords = (vec2){0, 0};
+    }
+    double box_pixels = box_empty ? 0 : (max_coords.x - min_coords.x + 1) * (max_coords.y - min_coords.y + 1);
+
+    // Counters are per thread, so each output opens its own here
+    if (PERF_COUNTERS && !out->perf_setup) {
+        setup_perf_counters(&out->perf);
+        out->perf_setup = 1;
+    }
+
+    begin_output_frame(out);
+
+    begin_perf_stage(&out->perf);
+    if (CHECKERBOARD && prepare_sample_history(&out->history, out->vinfo.xres, out->vinfo.yres, state->downscaling_factor))
+        state->kernels.render_checkerboard(out->buffer, out->vinfo.xres, out->vinfo.yres, min_coords, max_coords, state->downscaling_factor, &frame, &out->history);
+    else
+        state->kernels.render_pixels(out->buffer, out->vinfo.xres, out->vinfo.yres, min_coords, max_coords, state->downscaling_factor, &frame);
+
+    if (RENDER_BOUNDING_BOX && !box_empty) {
+        // Draw top and bottom edges
+        for (int x = (int)min_coords.x; x <= (int)max_coords.x; x++) {
+            if (RENDER_OVER_TEXT) {
+                paint_pixel(x, (int)min_coords.y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                paint_pixel(x, (int)max_coords.y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+            }
+            else {
+                vec4 top_color = {out->buffer[((int)min_coords.y*out->vinfo.xres+x)*4],
+                    out->buffer[((int)min_coords.y*out->vinfo.xres+x)*4+1],
+                    out->buffer[((int)min_coords.y*out->vinfo.xres+x)*4+2],
+                    out->buffer[((int)min_coords.y*out->vinfo.xres+x)*4+3]};
+
+                vec4 bottom_color = {out->buffer[((int)max_coords.y*out->vinfo.xres+x)*4],
+                    out->buffer[((int)max_coords.y*out->vinfo.xres+x)*4+1],
+                    out->buffer[((int)max_coords.y*out->vinfo.xres+x)*4+2],
+                    out->buffer[((int)max_coords.y*out->vinfo.xres+x)*4+3]};
+                if (top_color.w == 87 || (top_color.x == 0 && top_color.y == 0 && top_color.z == 0))
+                {
+                    paint_pixel(x, (int)min_coords.y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                }
+                if (bottom_color.w == 87 || (bottom_color.x == 0 && bottom_color.y == 0 && bottom_color.z == 0))
+                {
+                    paint_pixel(x, (int)max_coords.y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                }
+            }
+        }
+        // Draw left and right edges
+        for (int y = (int)min_coords.y; y <= (int)max_coords.y; y++) {
+            if (RENDER_OVER_TEXT) {
+                paint_pixel((int)min_coords.x, y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                paint_pixel((int)max_coords.x, y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+            }
+            else {
+                vec4 left_color = {out->buffer[(y*out->vinfo.xres+(int)min_coords.x)*4],
+                    out->buffer[((int)y*out->vinfo.xres+(int)min_coords.x)*4+1],
+                    out->buffer[((int)y*out->vinfo.xres+(int)min_coords.x)*4+2],
+                    out->buffer[((int)y*out->vinfo.xres+(int)min_coords.x)*4+3]};
+
+                vec4 right_color = {out->buffer[(y*out->vinfo.xres+(int)max_coords.x)*4],
+                    out->buffer[((int)y*out->vinfo.xres+(int)max_coords.x)*4+1],
+                    out->buffer[((int)y*out->vinfo.xres+(int)max_coords.x)*4+2],
+                    out->buffer[((int)y*out->vinfo.xres+(int)max_coords.x)*4+3]};
+
+                if (left_color.w == 87 || (left_color.x == 0 && left_color.y == 0 && left_color.z == 0))
+                {
+                    paint_pixel(min_coords.x, y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                }
+                if (right_color.w == 87 || (right_color.x == 0 && right_color.y == 0 && right_color.z == 0))
+                {
+                    paint_pixel(max_coords.x, y, (vec4){1,1,1,1}, out->buffer, out->vinfo.xres);
+                }
+            }
+        }
+    }
+    end_perf_stage(&out->perf, STAGE_RASTER, box_pixels);
+
+    if (BLUR_ANTIALIAS && !box_empty) {
+        begin_perf_stage(&out->perf);
+        state->kernels.blur(out->buffer, min_coords, max_coords, out->vinfo.xres, out->vinfo.yres);
+        end_perf_stage(&out->perf, STAGE_BLUR, box_pixels);
+    }
+
+    if (TERMINAL_OUTPUT) {
+        begin_perf_stage(&out->perf);
+        terminal_present(state->terminal, out->buffer, out->vinfo.xres, out->vinfo.yres);
+        end_perf_stage(&out->perf, STAGE_PRESENT, (double)out->vinfo.xres * out->vinfo.yres);
+    } else {
+        finish_output_frame(out, &state->kernels);
+    }
+
+    out->min_coords = min_coords;
+    out->max_coords = max_coords;
+}
+
+void report_output_counters(FILE *file, output outputs[], int count, int frames) {
+    perf_counters *perfs[2 * MAX_OUTPUTS];
+    for (int i = 0; i < count; i++) {
+        perfs[2*i] = &outputs[i].perf;
+        perfs[2*i + 1] = &outputs[i].present_perf;
+    }
+    report_perf_counters(file, perfs, 2 * count, frames);
+}
+
+// Times presenting to the framebuffer (or to memory when there is none)
+// with plain memcpy rows against the streaming present kernel
+void benchmark_present(const render_kernels *kernels, char *fbp, const char buffer[],
+                       int width, int height, int line_length) {
+    const int frames = 200;
+    size_t size = (size_t)line_length * height;
+    char *target = fbp ? fbp : alloc_shadow_buffer(size);
+    if (target == NULL) {
+        perror("Error allocating benchmark target");
+        return;
+    }
+    memset(target, 0, size); // Fault the pages in before timing
+
+    for (int method = 0; method < 2; method++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (int frame = 0; frame < frames; frame++) {
+            if (method == 0) {
+                for (int y = 0; y < height; y++)
+                    memcpy(target + (size_t)y*line_length, buffer + (size_t)y*width*4, (size_t)width*4);
+            } else {
+                kernels->present(target, buffer, width, height, line_length);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-10s %8.1f us/frame %8.1f MB/s\n", method == 0 ? "memcpy" : "streaming",
+               seconds / frames * 1e6, (double)width * height * 4 * frames / seconds / 1e6);
+    }
+    printf("(%dx%d to %s, %s kernels)\n", width, height, fbp ? "framebuffer" : "memory", kernels->name);
+
+    if (!fbp)
+        free_shadow_buffer(target, size);
 }
 
-void paint_pixel(int x, int y, vec4 color, char buffer[], struct fb_var_screeninfo vinfo) {
-    color.x = fmin(fmax(color.x, 0), 1);
-    color.y = fmin(fmax(color.y, 0), 1);
-    color.z = fmin(fmax(color.z, 0), 1);
-    color.w = fmin(fmax(color.w, 0), 1);
-    buffer[(y*vinfo.xres+x)*4] = (unsigned int)(color.z * 255);
-    buffer[(y*vinfo.xres+x)*4+1] = (unsigned int)(color.y * 255);
-    buffer[(y*vinfo.xres+x)*4+2] = (unsigned int)(color.x * 255);
-    buffer[(y*vinfo.xres+x)*4+3] = (unsigned int)(87);
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  --replay <scenario>      Run a scenario instead of taking input\n");
+    fprintf(stderr, "  --report <file>          Write the replay frame time report here (default: stdout)\n");
+    fprintf(stderr, "  --baseline <report>      Fail if the replay is slower than this report\n");
+    fprintf(stderr, "  --record-input <file>    Save the keys pressed as a scenario\n");
+    fprintf(stderr, "  --shader <name|path>     Built in shader, or a shader plugin (see shader_api.h):\n");
+    fprintf(stderr, "                          ");
+    for (int i = 0; i < BUILTIN_SHADER_COUNT; i++)
+        fprintf(stderr, " %s", builtin_shaders[i]->name);
+    fprintf(stderr, " ./<plugin>.so\n");
+    fprintf(stderr, "  --bench-present          Compare present copies (memcpy vs streaming) and exit\n");
+    fprintf(stderr, "  --kernels <variant>      Render kernels to use instead of the best supported:\n");
+    fprintf(stderr, "                          ");
+    for (int i = 0; i < KERNEL_VARIANT_COUNT; i++)
+        fprintf(stderr, " %s", kernel_variants[i].name);
+    fprintf(stderr, "\n");
 }
 
 int main(int argc, char *argv[]) {
-    struct sigaction action;
-    memset(&action, 0, sizeof(struct sigaction));
-    action.sa_handler = term;
-    sigaction(SIGINT, &action, NULL);
+    const char *scenario_path = NULL;
+    const char *report_path = NULL;
+    const char *baseline_path = NULL;
+    const char *input_trace_path = NULL;
+    const char *kernels_name = NULL;
+    int bench_present = 0;
+    const char *shader_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            scenario_path = argv[++i];
+        } else if (!strcmp(argv[i], "--report") && i + 1 < argc) {
+            report_path = argv[++i];
+        } else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (!strcmp(argv[i], "--record-input") && i + 1 < argc) {
+            input_trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "--kernels") && i + 1 < argc) {
+            kernels_name = argv[++i];
+        } else if (!strcmp(argv[i], "--shader") && i + 1 < argc) {
+            shader_name = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-present")) {
+            bench_present = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    int fbfd = open(FB_DEVICE, O_RDWR);
-    if (fbfd == -1) {
-        perror("Error opening framebuffer device");
-        exit(1);
+    const render_kernels *selected_kernels = select_kernels(kernels_name);
+    if (selected_kernels == NULL) {
+        fprintf(stderr, "Unknown render kernels '%s'\n", kernels_name);
+        usage(argv[0]);
+        return 1;
+    }
+    render_kernels kernels = *selected_kernels;
+    printf("Render kernels: %s%s\n", kernels.name, kernels_name ? " (forced)" : "");
+
+    // Shader, the fixed point path only has the built in SHADER
+    const span_shader *shader = &SHADER;
+    shader_plugin plugin = {0};
+    if (shader_name && FIXED_POINT) {
+        fprintf(stderr, "--shader needs FIXED_POINT off in config.h\n");
+        return 1;
+    } else if (shader_name && is_shader_path(shader_name)) {
+        plugin.path = shader_name;
+        if (!load_shader_plugin(&plugin))
+            return 1;
+        shader = plugin.shader;
+    } else if (shader_name) {
+        shader = find_builtin_shader(shader_name);
+        if (shader == NULL) {
+            fprintf(stderr, "Unknown shader '%s'\n", shader_name);
+            usage(argv[0]);
+            return 1;
+        }
     }
+    printf("Shader: %s%s\n", shader->name, plugin.path ? " (plugin)" : "");
 
-    struct fb_var_screeninfo vinfo;
-    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo)) {
-        perror("Error reading variable information");
-        exit(1);
+    static const light3 lights[] = LIGHTS;
+    int light_count = sizeof(lights) / sizeof(light3);
+    if (light_count > MAX_LIGHTS) {
+        fprintf(stderr, "LIGHTS can have up to %d lights\n", MAX_LIGHTS);
+        return 1;
     }
 
-    struct fb_fix_screeninfo finfo;
-    if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo)) {
-        perror("Error reading fixed information");
-        exit(1);
+    static scenario scene;
+    if (scenario_path && !load_scenario(&scene, scenario_path))
+        return 1;
+
+    FILE *input_trace = NULL;
+    if (input_trace_path) {
+        input_trace = fopen(input_trace_path, "w");
+        if (input_trace == NULL) {
+            fprintf(stderr, "Error opening '%s': %s\n", input_trace_path, strerror(errno));
+            return 1;
+        }
+        fprintf(input_trace, "# Input recorded by tty_cube, replay with --replay\n");
     }
 
-    long screensize = vinfo.yres_virtual * finfo.line_length;
-    char* fbp = (char*)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
-    if ((intptr_t)fbp == -1) {
-        perror("Error mapping framebuffer to memory");
-        exit(1);
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = term;
+    sigaction(SIGINT, &action, NULL);
+
+    static output outputs[MAX_OUTPUTS];
+    int output_count = 0;
+    terminal_output term_out;
+    int downscaling_factor = DOWNSCALING_FACTOR;
+    if (scenario_path && scene.downscaling)
+        downscaling_factor = scene.downscaling;
+
+    if (TERMINAL_OUTPUT) {
+        if (!setup_terminal(&term_out)) {
+            perror("Error setting up terminal output");
+            exit(1);
+        }
+        // Two pixels per character cell, stacked vertically
+        output *out = &outputs[output_count++];
+        out->fbfd = -1;
+        out->vinfo.xres = term_out.columns;
+        out->vinfo.yres = term_out.rows * 2;
+        out->buffer_size = (size_t)out->vinfo.xres * out->vinfo.yres * 4;
+        out->buffer = out->buffers[0] = alloc_shadow_buffer(out->buffer_size);
+        if (out->buffer == NULL) {
+            perror("Error allocating draw buffer");
+            exit(1);
+        }
+        downscaling_factor = 1;
+    } else {
+        const output_config configs[] = FB_OUTPUTS;
+        for (int i = 0; i < sizeof(configs) / sizeof(output_config); i++) {
+            if (output_count == MAX_OUTPUTS) {
+                fprintf(stderr, "Only the first %d outputs are used\n", MAX_OUTPUTS);
+                break;
+            }
+            if (!open_output(&outputs[output_count], configs[i])) {
+                close_outputs(outputs, output_count);
+                exit(1);
+            }
+            output *out = &outputs[output_count++];
+            printf("Output %s: %dx%d, %d bits per pixel\n", out->config.device,
+                out->vinfo.xres, out->vinfo.yres, out->vinfo.bits_per_pixel);
+        }
     }
+    printf("Draw buffer: %s\n", shadow_buffer_kind);
 
     // Input device
+    // Terminals reached over serial usually have no local keyboard,
+    // so there the cube just spins without controls.
+    // Scenarios bring their own input
     const char *input_device = INPUT_DEVICE;
-    if (!setup_input(input_device)) {
-        munmap(fbp, screensize);
-        close(fbfd);
+    if (!scenario_path && !setup_input(input_device) && !TERMINAL_OUTPUT) {
+        close_outputs(outputs, output_count);
         return 1;
     }
 
-    size_t buffer_size = (size_t)vinfo.xres * vinfo.yres * 4;
-    char* buffer = calloc(buffer_size, 1);
-    if (buffer == NULL) {
-        perror("Error allocating draw buffer");
-        munmap(fbp, screensize);
-        close(fbfd);
-        exit(1);
+    if (bench_present) {
+        // Only screens that take 32 bit pixels go through the present kernel
+        output *out = &outputs[0];
+        char *fbp = out->fbp && out->vinfo.bits_per_pixel == 32 ? out->fbp : NULL;
+        benchmark_present(&kernels, fbp, out->buffer, out->vinfo.xres, out->vinfo.yres,
+            fbp ? out->finfo.line_length : out->vinfo.xres * 4);
+        close_outputs(outputs, output_count);
+        return 0;
     }
-    memcpy(buffer, fbp, 4 * vinfo.xres * vinfo.yres);
 
-    camera cam;
-    light3 light;
+    recorder rec;
+    if (RECORD && !setup_recorder(&rec, RECORD_FILE, outputs[0].vinfo.xres, outputs[0].vinfo.yres)) {
+        close_recorder(&rec);
+        close_outputs(outputs, output_count);
+        exit(1);
+    }
+    frame_exporter exporter;
+    if (EXPORT_FRAMES && !setup_exporter(&exporter, EXPORT_NAME, EXPORT_SLOTS, outputs[0].vinfo.xres, outputs[0].vinfo.yres)) {
+        if (RECORD)
+            close_recorder(&rec);
+        close_outputs(outputs, output_count);
+        exit(1);
+    }
 
 #ifdef IMAGE
     FILE* image_file = fopen(IMAGE, "r");
     fread(image_data, SIDE_LENGTH*SIDE_LENGTH, 3, image_file);
     fclose(image_file);
 #endif
+#ifdef VIDEO_FACES
+    const char *video_paths[6] = VIDEO_FACES;
+    video_player videos;
+    if (!setup_videos(&videos, video_paths)) {
+        if (RECORD)
+            close_recorder(&rec);
+        if (EXPORT_FRAMES)
+            close_exporter(&exporter);
+        close_outputs(outputs, output_count);
+        exit(1);
+    }
+#endif
+
+    setup_specular_table();
+#if FIXED_POINT
+    setup_fixed_tables();
+#endif
+
+    frame_state state = {kernels, shader, downscaling_factor, TERMINAL_OUTPUT ? &term_out : NULL};
+    memcpy(state.lights, lights, sizeof(lights));
+    state.light_count = light_count;
+    output_pool pool;
+    if (!start_output_pool(&pool, outputs, output_count, draw_output, &state)) {
+        stop_output_pool(&pool);
+        if (RECORD)
+            close_recorder(&rec);
+        if (EXPORT_FRAMES)
+            close_exporter(&exporter);
+#ifdef VIDEO_FACES
+        close_videos(&videos);
+#endif
+        close_outputs(outputs, output_count);
+        exit(1);
+    }
 
     double time = 0;
     double time_cyclic = 0;
@@ -180,14 +592,89 @@ int main(int argc, char *argv[]) {
     vec3 camera_rotation = (vec3) {0, 0, 0};
     int move_speed = 3000;
     int rotation_speed = PI*0.7;
+    vec3 light_offset = lights[0].position; // Scenarios move the first light
+
+    int perf_frames = 0;
+    struct timespec perf_reported = start;
+
+    KeyState traced_keys = {0};
+    int traced_frames = 0;
+    double traced_time = 0;
+    double traced_delta = -1;
+
+    // Idle handling, see IDLE_TIMEOUT. Replays and input traces need
+    // every frame, so they always render
+    int idle_aware = IDLE_TIMEOUT > 0 && !scenario_path && !input_trace;
+    double attract_interval_us = ATTRACT_FPS > 0 ? 1000000.0 / ATTRACT_FPS : 0;
+    double idle_time = 0;
+    int redraw = 1;
+    double drawn_time = 0;
+    vec3 drawn_position, drawn_rotation, drawn_light;
 
     while (!done) {
         clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-        time += SPEED*delta*20;
+        if (scenario_path) {
+            if (scene.frame == scene.frame_count) { done = 1; continue; }
+            delta = scenario_delta(&scene, scene.frame);
+        }
+        if (scenario_path) {
+            key_state = scenario_keys(&scene, scene.frame);
+        } else {
+            KeyState released = {0};
+            if (process_input_events() || memcmp(&key_state, &released, sizeof(KeyState)))
+                idle_time = 0;
+            else
+                idle_time += delta;
+        }
+        if (key_state.q) { done = 1; continue; }
+
+        // Once idle, the cube stops turning unless there's an attract mode
+        int idle = idle_aware && idle_time >= IDLE_TIMEOUT;
+        if (!idle || ATTRACT_FPS > 0)
+            time += SPEED*delta*20;
         time_cyclic = ((int)time%100)/(100/2.0);
 
-        process_input_events();
-        if (key_state.q) { done = 1; continue; }
+        if (input_trace) {
+            if (traced_frames == 0 || memcmp(&key_state, &traced_keys, sizeof(KeyState))) {
+                char keys[16];
+                scenario_format_keys(key_state, keys);
+                fprintf(input_trace, "input %d %s\n", traced_frames, keys);
+                traced_keys = key_state;
+            }
+            // Live frames take as long as they take, replays follow suit
+            if (delta != traced_delta) {
+                fprintf(input_trace, "step %d %.9f\n", traced_frames, delta);
+                traced_delta = delta;
+            }
+            traced_frames++;
+            traced_time += delta;
+        }
+
+        if (TERMINAL_OUTPUT && terminal_resized) {
+            terminal_resized = 0;
+            if (!terminal_resize(&term_out)) {
+                done = 1;
+                continue;
+            }
+            output *out = &outputs[0];
+            out->vinfo.xres = term_out.columns;
+            out->vinfo.yres = term_out.rows * 2;
+            free_shadow_buffer(out->buffer, out->buffer_size);
+            out->buffer_size = (size_t)out->vinfo.xres * out->vinfo.yres * 4;
+            out->buffer = out->buffers[0] = alloc_shadow_buffer(out->buffer_size);
+            if (out->buffer == NULL) {
+                perror("Error allocating draw buffer");
+                done = 1;
+                continue;
+            }
+            redraw = 1;
+        }
+
+        // No output is drawing between frames, so the shader can change
+        if (SHADER_HOT_RELOAD && plugin.path && reload_shader_plugin(&plugin)) {
+            state.shader = plugin.shader;
+            redraw = 1;
+        }
 
         // Camera movement
         vec3 forward = { -cos(camera_rotation.y + PI/2.0), 0, sin(camera_rotation.y + PI/2.0) };
@@ -207,180 +694,90 @@ int main(int argc, char *argv[]) {
         if (key_state.space) camera_position.y -= move_speed * delta;
         if (key_state.shift) camera_position.y += move_speed * delta;
 
-        // Camera setup
-        cam = (camera){-SIDE_LENGTH,
-            time,
-            (vec2){vinfo.xres, vinfo.yres},
-            camera_rotation,
-            camera_position,
-            (vec3){1,1,1},
-            (vec2){0,0},
-            (vec3){0,0,0},
-            (vec3){0,0,0},
-            (vec3){0,0,0},
-            (vec3){0,0,0},
-            (vec3){0,0,0}
-        };
-        camera transformed_cam = setup_camera(cam);
-
-        // Light setup
-        vec3 light_offset = (vec3){SIDE_LENGTH*4,-SIDE_LENGTH*5,-SIDE_LENGTH*2};
-        light = (light3){
-            (vec3){1,1,1},
-            light_offset,
-        };
-
-        // Bounding box for cube
-        vec3 vertices[8] = {
-            (vec3){SIDE_LENGTH/2, SIDE_LENGTH/2, SIDE_LENGTH/2},
-            (vec3){SIDE_LENGTH/2, SIDE_LENGTH/2, -SIDE_LENGTH/2},
-            (vec3){SIDE_LENGTH/2, -SIDE_LENGTH/2, SIDE_LENGTH/2},
-            (vec3){SIDE_LENGTH/2, -SIDE_LENGTH/2, -SIDE_LENGTH/2},
-            (vec3){-SIDE_LENGTH/2, SIDE_LENGTH/2, SIDE_LENGTH/2},
-            (vec3){-SIDE_LENGTH/2, SIDE_LENGTH/2, -SIDE_LENGTH/2},
-            (vec3){-SIDE_LENGTH/2, -SIDE_LENGTH/2, SIDE_LENGTH/2},
-            (vec3){-SIDE_LENGTH/2, -SIDE_LENGTH/2, -SIDE_LENGTH/2}
-        };
-
-        for (int i = 0; i < 8; i++) {
-            vertices[i] = rotate_vec3_y(vertices[i], time*4*PI/1000);
+        // Keyframed scenario tracks override everything above
+        if (scenario_path) {
+            vec3 value;
+            if (scenario_track_value(&scene, TRACK_TIME, scene.frame, &value))
+                time = value.x;
+            if (scenario_track_value(&scene, TRACK_CAMERA_POSITION, scene.frame, &value))
+                camera_position = value;
+            if (scenario_track_value(&scene, TRACK_CAMERA_ROTATION, scene.frame, &value))
+                camera_rotation = value;
+            if (scenario_track_value(&scene, TRACK_LIGHT_POSITION, scene.frame, &value))
+                light_offset = value;
         }
 
-        vec2 min_coords = {vinfo.xres, vinfo.yres};
-        vec2 max_coords = {0, 0};
-
-        for (int i = 0; i < 8; i++) {
-            vec2 screen = project_vertex_to_screen(vertices[i], transformed_cam);
-            if (screen.x < min_coords.x) min_coords.x = screen.x;
-            if (screen.y < min_coords.y) min_coords.y = screen.y;
-            if (screen.x > max_coords.x) max_coords.x = screen.x;
-            if (screen.y > max_coords.y) max_coords.y = screen.y;
+        // Nothing changed since the last frame, so it's still on screen.
+        // Skip it and sleep until something happens
+        if (idle_aware && !redraw && time == drawn_time &&
+            !memcmp(&camera_position, &drawn_position, sizeof(vec3)) &&
+            !memcmp(&camera_rotation, &drawn_rotation, sizeof(vec3)) &&
+            !memcmp(&light_offset, &drawn_light, sizeof(vec3))) {
+            // A shader being worked on still reloads while idle
+            wait_for_input(SHADER_HOT_RELOAD && plugin.path ? 1000 : -1);
+            continue;
         }
-
-        // Clamp to screen
-        min_coords.x = fmax(0, min_coords.x);
-        min_coords.y = fmax(0, min_coords.y);
-        max_coords.x = fmin(vinfo.xres-1, max_coords.x);
-        max_coords.y = fmin(vinfo.yres-1, max_coords.y);
-
-        for (int j = 0; j < vinfo.yres; j += DOWNSCALING_FACTOR) {
-            for (int i = 0; i < vinfo.xres; i += DOWNSCALING_FACTOR) {
-                if (i >= (int)min_coords.x && i <= (int)max_coords.x &&
-                    j >= (int)min_coords.y && j <= (int)max_coords.y) {
-                    if (RENDER_OVER_TEXT) {
-                        vec4 color = get_pixel_through_camera(i, j, transformed_cam, light);
-                        for (int dc_offset_x = 0; dc_offset_x < DOWNSCALING_FACTOR; dc_offset_x++)
-                            for (int dc_offset_y = 0; dc_offset_y < DOWNSCALING_FACTOR; dc_offset_y++)
-                                paint_pixel(i + dc_offset_x, j + dc_offset_y, color, buffer, vinfo);
-                    } else {
-                        for (int dc_offset_x = 0; dc_offset_x < DOWNSCALING_FACTOR; dc_offset_x++) {
-                            for (int dc_offset_y = 0; dc_offset_y < DOWNSCALING_FACTOR; dc_offset_y++) {
-                                int x_off = i + dc_offset_x;
-                                int y_off = j + dc_offset_y;
-                                vec4 fb_color = {buffer[(y_off*vinfo.xres+x_off)*4],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+1],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+2],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+3]};
-                                if (fb_color.x == 0 && fb_color.y == 0 && fb_color.z == 0) {
-                                    vec4 color = get_pixel_through_camera(i, j, transformed_cam, light);
-                                    paint_pixel(x_off, y_off, color, buffer, vinfo);
-                                } else if (fb_color.w == 87) {
-                                    vec4 color = get_pixel_through_camera(i, j, transformed_cam, light);
-                                    paint_pixel(x_off, y_off, color, buffer, vinfo);
-                                }
-                            }
-                        }
-                    }
-                } else {
-                    if (RENDER_OVER_TEXT) {
-                        for (int dc_offset_x = 0; dc_offset_x < DOWNSCALING_FACTOR; dc_offset_x++)
-                            for (int dc_offset_y = 0; dc_offset_y < DOWNSCALING_FACTOR; dc_offset_y++)
-                                paint_pixel(i + dc_offset_x, j + dc_offset_y, (vec4){0,0,0,0}, buffer, vinfo);
-                    } else {
-                        for (int dc_offset_x = 0; dc_offset_x < DOWNSCALING_FACTOR; dc_offset_x++) {
-                            for (int dc_offset_y = 0; dc_offset_y < DOWNSCALING_FACTOR; dc_offset_y++) {
-                                int x_off = i + dc_offset_x;
-                                int y_off = j + dc_offset_y;
-                                vec4 fb_color = {buffer[(y_off*vinfo.xres+x_off)*4],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+1],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+2],
-                                    buffer[(y_off*vinfo.xres+x_off)*4+3]};
-                                if (fb_color.w == 87)
-                                    paint_pixel(x_off, y_off, (vec4){0,0,0,0}, buffer, vinfo);
-                            }
-                        }
-                    }
-                }
-            }
+        redraw = 0;
+        drawn_time = time;
+        drawn_position = camera_position;
+        drawn_rotation = camera_rotation;
+        drawn_light = light_offset;
+
+        state.time = time;
+        state.camera_position = camera_position;
+        state.camera_rotation = camera_rotation;
+        state.lights[0].position = light_offset;
+        if (!TERMINAL_OUTPUT) {
+            printf("\r");
+            fflush(stdout);
         }
-
-        if (RENDER_BOUNDING_BOX) {
-            // Draw top and bottom edges
-            for (int x = (int)min_coords.x; x <= (int)max_coords.x; x++) {
-                if (RENDER_OVER_TEXT) {
-                    paint_pixel(x, (int)min_coords.y, (vec4){1,1,1,1}, buffer, vinfo);
-                    paint_pixel(x, (int)max_coords.y, (vec4){1,1,1,1}, buffer, vinfo);
-                }
-                else {
-                    vec4 top_color = {buffer[((int)min_coords.y*vinfo.xres+x)*4],
-                        buffer[((int)min_coords.y*vinfo.xres+x)*4+1],
-                        buffer[((int)min_coords.y*vinfo.xres+x)*4+2],
-                        buffer[((int)min_coords.y*vinfo.xres+x)*4+3]};
-
-                    vec4 bottom_color = {buffer[((int)max_coords.y*vinfo.xres+x)*4],
-                        buffer[((int)max_coords.y*vinfo.xres+x)*4+1],
-                        buffer[((int)max_coords.y*vinfo.xres+x)*4+2],
-                        buffer[((int)max_coords.y*vinfo.xres+x)*4+3]};
-                    if (top_color.w == 87 || (top_color.x == 0 && top_color.y == 0 && top_color.z == 0))
-                    {
-                        paint_pixel(x, (int)min_coords.y, (vec4){1,1,1,1}, buffer, vinfo);
-                    }
-                    if (bottom_color.w == 87 || (bottom_color.x == 0 && bottom_color.y == 0 && bottom_color.z == 0))
-                    {
-                        paint_pixel(x, (int)max_coords.y, (vec4){1,1,1,1}, buffer, vinfo);
-                    }
-                }
-            }
-            // Draw left and right edges
-            for (int y = (int)min_coords.y; y <= (int)max_coords.y; y++) {
-                if (RENDER_OVER_TEXT) {
-                    paint_pixel((int)min_coords.x, y, (vec4){1,1,1,1}, buffer, vinfo);
-                    paint_pixel((int)max_coords.x, y, (vec4){1,1,1,1}, buffer, vinfo);
-                }
-                else {
-                    vec4 left_color = {buffer[(y*vinfo.xres+(int)min_coords.x)*4],
-                        buffer[((int)y*vinfo.xres+(int)min_coords.x)*4+1],
-                        buffer[((int)y*vinfo.xres+(int)min_coords.x)*4+2],
-                        buffer[((int)y*vinfo.xres+(int)min_coords.x)*4+3]};
-
-                    vec4 right_color = {buffer[(y*vinfo.xres+(int)max_coords.x)*4],
-                        buffer[((int)y*vinfo.xres+(int)max_coords.x)*4+1],
-                        buffer[((int)y*vinfo.xres+(int)max_coords.x)*4+2],
-                        buffer[((int)y*vinfo.xres+(int)max_coords.x)*4+3]};
-
-                    if (left_color.w == 87 || (left_color.x == 0 && left_color.y == 0 && left_color.z == 0))
-                    {
-                        paint_pixel(min_coords.x, y, (vec4){1,1,1,1}, buffer, vinfo);
-                    }
-                    if (right_color.w == 87 || (right_color.x == 0 && right_color.y == 0 && right_color.z == 0))
-                    {
-                        paint_pixel(max_coords.x, y, (vec4){1,1,1,1}, buffer, vinfo);
-                    }
-                }
+#ifdef VIDEO_FACES
+        update_videos(&videos, time);
+#endif
+        draw_outputs(&pool);
+        perf_frames++;
+
+        // The screen is the terminal there, so it only gets the report at exit
+        if (PERF_COUNTERS && PERF_REPORT_INTERVAL > 0 && !TERMINAL_OUTPUT) {
+            clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+            if (end.tv_sec - perf_reported.tv_sec >= PERF_REPORT_INTERVAL) {
+                // The present threads count too, let them finish
+                for (int i = 0; i < output_count; i++)
+                    flush_output(&outputs[i]);
+                report_output_counters(stderr, outputs, output_count, perf_frames);
+                perf_reported = end;
+                perf_frames = 0;
             }
         }
-        if (BLUR_ANTIALIAS)
-            blur_pixels(buffer, min_coords, max_coords, vinfo.xres, vinfo.yres);
-
 
-        printf("\r");
-        fflush(stdout);
-        memcpy(fbp, buffer, 4 * vinfo.xres * vinfo.yres);
+        if (RECORD || EXPORT_FRAMES) {
+            // Only the first output is recorded and exported. Everything
+            // painted this frame lies in its bounding box, the downscaled
+            // blocks can reach past its right and bottom edges
+            output *out = &outputs[0];
+            int x1 = fmin(out->vinfo.xres, (int)out->max_coords.x + downscaling_factor);
+            int y1 = fmin(out->vinfo.yres, (int)out->max_coords.y + downscaling_factor);
+            record_rect drawn = {(int)out->min_coords.x, (int)out->min_coords.y,
+                x1 - (int)out->min_coords.x, y1 - (int)out->min_coords.y};
+            if (RECORD)
+                record_frame(&rec, out->buffer, out->vinfo.xres, out->vinfo.yres, drawn);
+            if (EXPORT_FRAMES)
+                export_frame(&exporter, out->buffer, out->vinfo.xres, out->vinfo.yres, drawn);
+        }
 
         clock_gettime(CLOCK_MONOTONIC_RAW, &end);
         delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
 
-        if (FRAME_LIMIT > 0) {
+        if (scenario_path) {
+            // Fixed time step, run as fast as possible
+            scene.frame_times_us[scene.frame++] = delta_us;
+        } else if (idle && ATTRACT_FPS > 0) {
+            // Attract mode, a key press ends the wait early
+            if (delta_us < attract_interval_us)
+                wait_for_input((attract_interval_us - delta_us) / 1000);
+            clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+            delta = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        } else if (FRAME_LIMIT > 0) {
             if (delta_us < 1000000.0 / FRAME_LIMIT) {
                 usleep(1000000.0 / FRAME_LIMIT - delta_us);
                 delta = 1.0 / FRAME_LIMIT;
@@ -391,9 +788,44 @@ int main(int argc, char *argv[]) {
             delta = delta_us/1000000.0;
         }
     }
-    munmap(fbp, screensize);
-    close(fbfd);
-    free(buffer);
-    return 0;
+    if (TERMINAL_OUTPUT)
+        cleanup_terminal();
+    if (RECORD)
+        close_recorder(&rec);
+    if (EXPORT_FRAMES)
+        close_exporter(&exporter);
+    stop_output_pool(&pool);
+#ifdef VIDEO_FACES
+    close_videos(&videos);
+#endif
+    if (PERF_COUNTERS)
+        report_output_counters(stderr, outputs, output_count, perf_frames);
+    close_outputs(outputs, output_count);
+    close_shader_plugin(&plugin);
+
+    if (input_trace) {
+        fprintf(input_trace, "frames %d\n", traced_frames);
+        // Only what the report shows, every frame has its step
+        fprintf(input_trace, "delta %f\n", traced_time > 0 ? traced_time / traced_frames : 1.0 / 60);
+        fclose(input_trace);
+    }
+
+    int rc = 0;
+    if (scenario_path) {
+        scenario_stats stats = scenario_statistics(&scene, scene.frame);
+        FILE *report = report_path ? fopen(report_path, "w") : stdout;
+        if (report == NULL) {
+            fprintf(stderr, "Error opening '%s': %s\n", report_path, strerror(errno));
+            report = stdout;
+        }
+        write_scenario_report(report, &scene, scene.frame, stats);
+        if (report != stdout)
+            fclose(report);
+        if (baseline_path && !compare_scenario_baseline(baseline_path, stats, stderr))
+            rc = 2;
+        free(scene.frame_times_us);
+        free(scene.steps);
+    }
+    return rc;
 }
 
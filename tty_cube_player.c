@@ -0,0 +1,383 @@
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "record.h"
+#include "export.h"
+
+// Plays back streams written with RECORD set in config.h, or saves
+// frames exported live with EXPORT_FRAMES
+
+volatile sig_atomic_t done = 0;
+
+void term(int signum) { done = 1; }
+
+typedef struct player
+{
+    FILE *file;
+    record_file_header header;
+    uint32_t *frame; // Screen as of the last decoded frame
+    uint32_t *scratch;
+    unsigned char *payload;
+    size_t payload_capacity;
+
+    // Seek index, only present when the recording was closed cleanly
+    record_index_entry *index;
+    unsigned int index_count;
+} player;
+
+int open_player(player *play, const char *path) {
+    memset(play, 0, sizeof(player));
+    play->file = fopen(path, "rb");
+    if (play->file == NULL) {
+        fprintf(stderr, "Error opening recording '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    if (fread(&play->header, sizeof(record_file_header), 1, play->file) != 1 ||
+        memcmp(play->header.magic, RECORD_MAGIC, 8) ||
+        play->header.format != RECORD_FORMAT_BGRA32) {
+        fprintf(stderr, "'%s' is not a TTY-Cube recording\n", path);
+        return 0;
+    }
+
+    size_t pixels = (size_t)play->header.width * play->header.height;
+    play->frame = calloc(pixels, 4);
+    play->scratch = malloc(pixels * 4);
+    if (play->frame == NULL || play->scratch == NULL) {
+        perror("Error allocating frame buffers");
+        return 0;
+    }
+
+    // Load the index if there is one
+    record_file_footer footer;
+    if (fseeko(play->file, -(off_t)sizeof(footer), SEEK_END) == 0 &&
+        fread(&footer, sizeof(footer), 1, play->file) == 1 &&
+        !memcmp(footer.magic, RECORD_INDEX_MAGIC, 8)) {
+        play->index = malloc((size_t)footer.frame_count * sizeof(record_index_entry));
+        if (play->index != NULL &&
+            fseeko(play->file, footer.index_offset, SEEK_SET) == 0 &&
+            fread(play->index, sizeof(record_index_entry), footer.frame_count, play->file) == footer.frame_count) {
+            play->index_count = footer.frame_count;
+        }
+    }
+    fseeko(play->file, sizeof(record_file_header), SEEK_SET);
+    return 1;
+}
+
+void close_player(player *play) {
+    if (play->file) fclose(play->file);
+    free(play->frame);
+    free(play->scratch);
+    free(play->payload);
+    free(play->index);
+}
+
+// Decodes the next frame into play->frame. Returns 0 at the end of the stream
+int next_frame(player *play, record_frame_header *header) {
+    if (fread(header, sizeof(record_frame_header), 1, play->file) != 1 ||
+        header->magic != RECORD_FRAME_MAGIC) {
+        return 0;
+    }
+    if (header->x + header->width > play->header.width ||
+        header->y + header->height > play->header.height) {
+        fprintf(stderr, "Frame %u is out of bounds\n", header->index);
+        return 0;
+    }
+    if (header->payload_size > play->payload_capacity) {
+        unsigned char *grown = realloc(play->payload, header->payload_size);
+        if (grown == NULL) {
+            perror("Error allocating payload buffer");
+            return 0;
+        }
+        play->payload = grown;
+        play->payload_capacity = header->payload_size;
+    }
+    if (fread(play->payload, 1, header->payload_size, play->file) != header->payload_size) {
+        fprintf(stderr, "Frame %u is truncated\n", header->index);
+        return 0;
+    }
+
+    size_t count = (size_t)header->width * header->height;
+    if (!record_rle_decode(play->payload, header->payload_size, play->scratch, count)) {
+        fprintf(stderr, "Frame %u is corrupted\n", header->index);
+        return 0;
+    }
+
+    int keyframe = header->flags & RECORD_FLAG_KEYFRAME;
+    const uint32_t *source = play->scratch;
+    for (uint32_t y = header->y; y < header->y + header->height; y++) {
+        uint32_t *row = play->frame + (size_t)y*play->header.width + header->x;
+        for (uint32_t x = 0; x < header->width; x++)
+            row[x] = keyframe ? source[x] : row[x] ^ source[x];
+        source += header->width;
+    }
+    return 1;
+}
+
+// Positions the stream so that the next decoded frame is the keyframe
+// at or before frame `target`. Without an index this decodes from the start
+void seek_player(player *play, unsigned int target) {
+    unsigned int keyframe = 0;
+    for (unsigned int i = 0; i < play->index_count && i <= target; i++) {
+        if (play->index[i].flags & RECORD_FLAG_KEYFRAME)
+            keyframe = i;
+    }
+    if (keyframe < play->index_count)
+        fseeko(play->file, play->index[keyframe].offset, SEEK_SET);
+    else
+        fseeko(play->file, sizeof(record_file_header), SEEK_SET);
+}
+
+int write_ppm(const char *path, const uint32_t *frame, int width, int height) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    unsigned char *row = malloc((size_t)width * 3);
+    for (int y = 0; y < height && row; y++) {
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = frame[(size_t)y*width + x];
+            // BGRA in memory
+            row[x*3] = (pixel >> 16) & 0xFF;
+            row[x*3+1] = (pixel >> 8) & 0xFF;
+            row[x*3+2] = pixel & 0xFF;
+        }
+        fwrite(row, 3, width, file);
+    }
+    free(row);
+    fclose(file);
+    return row != NULL;
+}
+
+int export_ppm(player *play, const char *prefix, unsigned int first, unsigned int last) {
+    record_frame_header header;
+    char path[4096];
+    seek_player(play, first);
+    while (!done && next_frame(play, &header) && header.index <= last) {
+        if (header.index < first)
+            continue;
+        snprintf(path, sizeof(path), "%s%06u.ppm", prefix, header.index);
+        if (!write_ppm(path, play->frame, play->header.width, play->header.height))
+            return 1;
+    }
+    return 0;
+}
+
+int replay_framebuffer(player *play, const char *device, unsigned int first) {
+    int fbfd = open(device, O_RDWR);
+    if (fbfd == -1) {
+        perror("Error opening framebuffer device");
+        return 1;
+    }
+
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) || ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo)) {
+        perror("Error reading framebuffer information");
+        close(fbfd);
+        return 1;
+    }
+    if (vinfo.bits_per_pixel != 32) {
+        fprintf(stderr, "Only 32 bit framebuffers are supported\n");
+        close(fbfd);
+        return 1;
+    }
+
+    long screensize = vinfo.yres_virtual * finfo.line_length;
+    char* fbp = (char*)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+    if ((intptr_t)fbp == -1) {
+        perror("Error mapping framebuffer to memory");
+        close(fbfd);
+        return 1;
+    }
+
+    // Crop whatever doesn't fit on this screen
+    int width = play->header.width < vinfo.xres ? play->header.width : vinfo.xres;
+    int height = play->header.height < vinfo.yres ? play->header.height : vinfo.yres;
+
+    record_frame_header header;
+    struct timespec start;
+    uint64_t first_timestamp = 0;
+    int started = 0;
+    seek_player(play, first);
+    while (!done && next_frame(play, &header)) {
+        if (header.index < first)
+            continue;
+        if (!started) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            first_timestamp = header.timestamp_us;
+            started = 1;
+        }
+
+        // Wait until the frame is due
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed_us = (now.tv_sec - start.tv_sec) * 1000000ll + (now.tv_nsec - start.tv_nsec) / 1000;
+        int64_t wait_us = (int64_t)(header.timestamp_us - first_timestamp) - elapsed_us;
+        if (wait_us > 0)
+            usleep(wait_us);
+
+        for (int y = 0; y < height; y++)
+            memcpy(fbp + (size_t)y*finfo.line_length, play->frame + (size_t)y*play->header.width, width * 4);
+    }
+
+    munmap(fbp, screensize);
+    close(fbfd);
+    return 0;
+}
+
+// Saves frames from a running tty_cube as they come, straight out of
+// the shared memory. Frames that come faster than they can be saved are
+// skipped, and so are frames the writer overwrote while being saved and
+// frames in a format this player doesn't know
+int export_live(const char *name, const char *prefix, unsigned int count) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening exported frames '%s': %s (is EXPORT_FRAMES on?)\n", name, strerror(errno));
+        return 1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < (off_t)sizeof(export_header)) {
+        fprintf(stderr, "'%s' is not a TTY-Cube export\n", name);
+        close(fd);
+        return 1;
+    }
+    export_header *header = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("Error mapping exported frames");
+        return 1;
+    }
+    if (memcmp(header->magic, EXPORT_MAGIC, 8) || header->version != EXPORT_VERSION ||
+        sizeof(export_header) + header->slot_size * header->slot_count > (uint64_t)info.st_size) {
+        fprintf(stderr, "'%s' is not a TTY-Cube export\n", name);
+        munmap(header, info.st_size);
+        return 1;
+    }
+
+    char path[4096];
+    uint64_t last = 0;
+    uint64_t dropped_frame = 0; // Last frame counted as torn or unreadable
+    unsigned int saved = 0, skipped = 0, torn = 0, unreadable = 0;
+    while (!done && saved < count) {
+        uint64_t sequence;
+        export_slot_header *slot = export_latest_frame(header, &sequence);
+        if (slot == NULL || slot->frame == last) {
+            usleep(1000);
+            continue;
+        }
+        uint64_t frame = slot->frame;
+        uint32_t width = slot->width;
+        uint32_t height = slot->height;
+        int readable = slot->format == EXPORT_FORMAT_BGRA32 && slot->stride == width * 4 &&
+            width <= header->max_width && height <= header->max_height;
+        if (!readable || !export_frame_valid(slot, sequence)) {
+            // Counted once per frame, the same slot comes back until the writer moves on
+            if (frame != dropped_frame) {
+                if (readable)
+                    torn++;
+                else
+                    unreadable++;
+                dropped_frame = frame;
+            }
+            usleep(1000);
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s%06llu.ppm", prefix, (unsigned long long)frame);
+        if (!write_ppm(path, (const uint32_t *)export_slot_pixels(slot), width, height))
+            break;
+        if (!export_frame_valid(slot, sequence)) {
+            unlink(path);
+            torn++;
+            dropped_frame = frame;
+            continue;
+        }
+        if (last)
+            skipped += frame - last - 1;
+        last = frame;
+        saved++;
+    }
+    fprintf(stderr, "Saved %u frames, skipped %u, %u overwritten while saving, %u in an unknown format\n",
+        saved, skipped, torn, unreadable);
+    munmap(header, info.st_size);
+    return 0;
+}
+
+void print_info(player *play) {
+    printf("Resolution: %ux%u\n", play->header.width, play->header.height);
+    if (play->index_count == 0) {
+        printf("No index (recording was not closed cleanly)\n");
+        return;
+    }
+    unsigned int keyframes = 0;
+    for (unsigned int i = 0; i < play->index_count; i++)
+        keyframes += play->index[i].flags & RECORD_FLAG_KEYFRAME;
+    printf("Frames: %u (%u keyframes)\n", play->index_count, keyframes);
+    printf("Duration: %.3fs\n", play->index[play->index_count - 1].timestamp_us / 1000000.0);
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s <recording> info\n", name);
+    fprintf(stderr, "  %s <recording> ppm <output_prefix> [first_frame] [last_frame]\n", name);
+    fprintf(stderr, "  %s <recording> fb [first_frame] [framebuffer_device]\n", name);
+    fprintf(stderr, "  %s <export_name> live <output_prefix> [frames]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = term;
+    sigaction(SIGINT, &action, NULL);
+
+    // Exported frames are no recording
+    if (!strcmp(argv[2], "live")) {
+        if (argc < 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        return export_live(argv[1], argv[3], argc > 4 ? strtoul(argv[4], NULL, 10) : UINT32_MAX);
+    }
+
+    player play;
+    if (!open_player(&play, argv[1])) {
+        close_player(&play);
+        return 1;
+    }
+
+    int rc = 0;
+    if (!strcmp(argv[2], "info")) {
+        print_info(&play);
+    } else if (!strcmp(argv[2], "ppm") && argc >= 4) {
+        unsigned int first = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+        unsigned int last = argc > 5 ? strtoul(argv[5], NULL, 10) : UINT32_MAX;
+        rc = export_ppm(&play, argv[3], first, last);
+    } else if (!strcmp(argv[2], "fb")) {
+        unsigned int first = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+        rc = replay_framebuffer(&play, argc > 4 ? argv[4] : FB_DEVICE, first);
+    } else {
+        usage(argv[0]);
+        rc = 1;
+    }
+    close_player(&play);
+    return rc;
+}
@@ -1,3 +1,7 @@
+// Functions on the per-pixel path are forced inline, so every render
+// kernel variant (see render.h) compiles them for its own instruction set
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
 typedef struct vec2 {
     double x;
     double y;
@@ -204,3 +208,130 @@ vec3 rotate_vec3_z(vec3 v, double angle) {
     result.z = v.z;
     return result;
 }
+
+// Matrices are row major, m[row][column], and multiply column vectors
+typedef struct mat3 {
+    double m[3][3];
+} mat3;
+
+typedef struct mat4 {
+    double m[4][4];
+} mat4;
+
+mat3 identity_mat3() {
+    mat3 result = {{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}};
+    return result;
+}
+
+mat4 identity_mat4() {
+    mat4 result = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}}};
+    return result;
+}
+
+mat3 multiply_mat3(mat3 a, mat3 b) {
+    mat3 result;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+    return result;
+}
+
+mat4 multiply_mat4(mat4 a, mat4 b) {
+    mat4 result;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j]
+                           + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+    return result;
+}
+
+mat3 transpose_mat3(mat3 a) {
+    mat3 result;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            result.m[i][j] = a.m[j][i];
+    return result;
+}
+
+vec3 multiply_mat3_vec3(mat3 a, vec3 v) {
+    vec3 result;
+    result.x = a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z;
+    result.y = a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z;
+    result.z = a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z;
+    return result;
+}
+
+// Same conventions as rotate_vec3_x/y/z
+mat3 rotation_mat3_x(double angle) {
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+    mat3 result = {{{1, 0, 0}, {0, cos_a, -sin_a}, {0, sin_a, cos_a}}};
+    return result;
+}
+
+mat3 rotation_mat3_y(double angle) {
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+    mat3 result = {{{cos_a, 0, sin_a}, {0, 1, 0}, {-sin_a, 0, cos_a}}};
+    return result;
+}
+
+mat3 rotation_mat3_z(double angle) {
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+    mat3 result = {{{cos_a, -sin_a, 0}, {sin_a, cos_a, 0}, {0, 0, 1}}};
+    return result;
+}
+
+// Rotation around an arbitrary axis (Rodrigues' formula)
+mat3 rotation_mat3_axis(vec3 axis, double angle) {
+    axis = normalize_vec3(axis);
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+    double k = 1 - cos_a;
+    double x = axis.x, y = axis.y, z = axis.z;
+    mat3 result = {{
+        {cos_a + x*x*k,   x*y*k - z*sin_a, x*z*k + y*sin_a},
+        {y*x*k + z*sin_a, cos_a + y*y*k,   y*z*k - x*sin_a},
+        {z*x*k - y*sin_a, z*y*k + x*sin_a, cos_a + z*z*k}
+    }};
+    return result;
+}
+
+// Affine transform from a rotation followed by a translation
+mat4 affine_mat4(mat3 rotation, vec3 translation) {
+    mat4 result = identity_mat4();
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            result.m[i][j] = rotation.m[i][j];
+    result.m[0][3] = translation.x;
+    result.m[1][3] = translation.y;
+    result.m[2][3] = translation.z;
+    return result;
+}
+
+// Inverse of an affine_mat4() whose rotation part is orthonormal
+mat4 inverse_affine_mat4(mat4 a) {
+    mat3 rotation;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            rotation.m[i][j] = a.m[j][i];
+    vec3 translation = multiply_mat3_vec3(rotation, (vec3){a.m[0][3], a.m[1][3], a.m[2][3]});
+    return affine_mat4(rotation, scale_vec3(translation, -1));
+}
+
+vec3 transform_point_mat4(mat4 a, vec3 v) {
+    vec3 result;
+    result.x = a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z + a.m[0][3];
+    result.y = a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z + a.m[1][3];
+    result.z = a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z + a.m[2][3];
+    return result;
+}
+
+vec3 transform_direction_mat4(mat4 a, vec3 v) {
+    vec3 result;
+    result.x = a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z;
+    result.y = a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z;
+    result.z = a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z;
+    return result;
+}
@@ -0,0 +1,304 @@
+// Video textures
+// With VIDEO_FACES set, each face of the cube can play its own looping
+// clip through the video shader. Clips are memory mapped, and a
+// prefetch thread decodes the frames the cube is about to reach into a
+// small ring per face. The main thread only ever picks a decoded frame
+// from the ring, so drawing never waits on the disk: a frame that isn't
+// ready in time just keeps the last one on screen a bit longer.
+// Memory use is VIDEO_PREFETCH + 1 decoded frames per face, plus
+// whatever the kernel keeps of the mapped files.
+//
+// Playback follows cube time, which runs at 20 per second with SPEED 1,
+// so clips speed up with SPEED and stop when the cube does.
+//
+// File layout (all integers little endian):
+//   video_file_header
+//   VIDEO_FORMAT_RAW: frame_count frames of width * height BGRA pixels
+//   VIDEO_FORMAT_RLE: uint64_t offsets[frame_count + 1] from the start
+//                     of the file, then every frame run length encoded
+//                     on its own, as in record.h
+// Make one out of any clip with ./setup_video.sh
+
+#define VIDEO_MAGIC "TTYCVID1"
+#define VIDEO_FORMAT_RAW 1
+#define VIDEO_FORMAT_RLE 2
+#define VIDEO_MAX_SIZE 4096 // Largest width and height taken
+#define VIDEO_SLOTS (VIDEO_PREFETCH + 1)
+#define VIDEO_EMPTY -1
+#define VIDEO_DECODING -2
+
+typedef struct video_file_header
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t frame_count;
+    uint32_t format;
+    uint32_t rate_numerator; // Frames per second, as a fraction
+    uint32_t rate_denominator;
+} video_file_header;
+
+typedef struct video_slot
+{
+    long frame; // VIDEO_EMPTY, VIDEO_DECODING or the frame it holds
+    uint32_t *pixels;
+} video_slot;
+
+typedef struct video_clip
+{
+    const char *path;
+    const unsigned char *data; // NULL for faces without a clip
+    size_t size;
+    video_file_header header;
+    double rate;
+
+    video_slot slots[VIDEO_SLOTS];
+    int shown; // Slot the face shows
+    long wanted; // Frame the cube is at
+    unsigned long late; // Frames that weren't decoded in time
+    int broken; // Whether a corrupted frame was reported already
+} video_clip;
+
+typedef struct video_player
+{
+    video_clip clips[6];
+    pthread_t thread;
+    int running;
+
+    // Held only to look at or change the slots, never while decoding
+    pthread_mutex_t lock;
+    pthread_cond_t wanted; // The cube moved on
+    int stopping;
+} video_player;
+
+size_t video_frame_size(const video_clip *clip)
+{
+    return (size_t)clip->header.width * clip->header.height * 4;
+}
+
+// Decodes a frame of the clip into pixels. Runs on the prefetch thread,
+// which is the one taking the page faults
+int decode_video_frame(const video_clip *clip, long frame, uint32_t *pixels)
+{
+    size_t size = video_frame_size(clip);
+    if (clip->header.format == VIDEO_FORMAT_RAW) {
+        memcpy(pixels, clip->data + sizeof(video_file_header) + size * frame, size);
+        return 1;
+    }
+    uint64_t offsets[2];
+    memcpy(offsets, clip->data + sizeof(video_file_header) + frame * sizeof(uint64_t), sizeof(offsets));
+    if (offsets[0] > offsets[1] || offsets[1] > clip->size)
+        return 0;
+    return record_rle_decode(clip->data + offsets[0], offsets[1] - offsets[0],
+        pixels, (size_t)clip->header.width * clip->header.height);
+}
+
+// Maps a clip and checks it's whole. Returns 0 after saying why not
+int open_video_clip(video_clip *clip, const char *path)
+{
+    memset(clip, 0, sizeof(video_clip));
+    clip->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening video '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < (off_t)sizeof(video_file_header)) {
+        fprintf(stderr, "'%s' is not a TTY-Cube video\n", path);
+        close(fd);
+        return 0;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping video '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    clip->data = data;
+    clip->size = info.st_size;
+    memcpy(&clip->header, clip->data, sizeof(video_file_header));
+
+    const video_file_header *header = &clip->header;
+    size_t frames_end = header->format == VIDEO_FORMAT_RAW
+        ? sizeof(video_file_header) + video_frame_size(clip) * header->frame_count
+        : sizeof(video_file_header) + sizeof(uint64_t) * ((size_t)header->frame_count + 1);
+    if (memcmp(header->magic, VIDEO_MAGIC, 8) ||
+        (header->format != VIDEO_FORMAT_RAW && header->format != VIDEO_FORMAT_RLE) ||
+        header->width == 0 || header->height == 0 || header->frame_count == 0 ||
+        header->width > VIDEO_MAX_SIZE || header->height > VIDEO_MAX_SIZE ||
+        header->rate_numerator == 0 || header->rate_denominator == 0 ||
+        frames_end > clip->size) {
+        fprintf(stderr, "'%s' is not a TTY-Cube video, or it's cut short\n", path);
+        return 0;
+    }
+    clip->rate = (double)header->rate_numerator / header->rate_denominator;
+    // Frames are read in order, mostly
+    madvise(data, clip->size, MADV_SEQUENTIAL);
+
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        clip->slots[i].frame = VIDEO_EMPTY;
+        clip->slots[i].pixels = malloc(video_frame_size(clip));
+        if (clip->slots[i].pixels == NULL) {
+            perror("Error allocating video frames");
+            return 0;
+        }
+    }
+
+    // The first frame is there before anything is drawn
+    if (!decode_video_frame(clip, 0, clip->slots[0].pixels)) {
+        fprintf(stderr, "'%s' has a broken first frame\n", path);
+        return 0;
+    }
+    clip->slots[0].frame = 0;
+    return 1;
+}
+
+void close_video_clip(video_clip *clip)
+{
+    for (int i = 0; i < VIDEO_SLOTS; i++) {
+        free(clip->slots[i].pixels);
+        clip->slots[i].pixels = NULL;
+    }
+    if (clip->data)
+        munmap((void *)clip->data, clip->size);
+    clip->data = NULL;
+}
+
+// Whether frame is one of the frames the prefetcher keeps ready
+int video_frame_wanted(const video_clip *clip, long frame)
+{
+    long ahead = (frame - clip->wanted + clip->header.frame_count) % clip->header.frame_count;
+    return ahead < VIDEO_PREFETCH;
+}
+
+void *video_thread(void *arg)
+{
+    video_player *player = arg;
+    pthread_mutex_lock(&player->lock);
+    while (!player->stopping) {
+        // Nearest frames first, across all faces
+        video_clip *clip = NULL;
+        video_slot *slot = NULL;
+        long frame = 0;
+        for (int ahead = 0; ahead < VIDEO_PREFETCH && slot == NULL; ahead++) {
+            for (int face = 0; face < 6 && slot == NULL; face++) {
+                clip = &player->clips[face];
+                if (clip->data == NULL)
+                    continue;
+                frame = (clip->wanted + ahead) % clip->header.frame_count;
+                int present = 0;
+                for (int i = 0; i < VIDEO_SLOTS; i++)
+                    present |= clip->slots[i].frame == frame;
+                if (present)
+                    continue;
+                // There's always a slot that is neither shown nor wanted
+                for (int i = 0; i < VIDEO_SLOTS && slot == NULL; i++) {
+                    video_slot *candidate = &clip->slots[i];
+                    if (i != clip->shown && (candidate->frame < 0 || !video_frame_wanted(clip, candidate->frame)))
+                        slot = candidate;
+                }
+            }
+        }
+        if (slot == NULL) {
+            pthread_cond_wait(&player->wanted, &player->lock);
+            continue;
+        }
+
+        slot->frame = VIDEO_DECODING;
+        pthread_mutex_unlock(&player->lock);
+        int decoded = decode_video_frame(clip, frame, slot->pixels);
+        pthread_mutex_lock(&player->lock);
+        // Shown as is rather than decoded again and again
+        if (!decoded && !clip->broken) {
+            fprintf(stderr, "Frame %ld of '%s' is corrupted\n", frame, clip->path);
+            clip->broken = 1;
+        }
+        slot->frame = frame;
+    }
+    pthread_mutex_unlock(&player->lock);
+    return NULL;
+}
+
+void close_videos(video_player *player)
+{
+    if (player->running) {
+        pthread_mutex_lock(&player->lock);
+        player->stopping = 1;
+        pthread_cond_signal(&player->wanted);
+        pthread_mutex_unlock(&player->lock);
+        pthread_join(player->thread, NULL);
+        player->running = 0;
+    }
+    for (int face = 0; face < 6; face++) {
+        video_clip *clip = &player->clips[face];
+        if (clip->late)
+            fprintf(stderr, "Video on face %d: %lu frames weren't decoded in time\n", face, clip->late);
+        close_video_clip(clip);
+    }
+}
+
+// Opens a clip for every face that has one, paths being NULL for the
+// rest, and starts prefetching
+int setup_videos(video_player *player, const char *paths[6])
+{
+    memset(player, 0, sizeof(video_player));
+    pthread_mutex_init(&player->lock, NULL);
+    pthread_cond_init(&player->wanted, NULL);
+    size_t memory = 0;
+    for (int face = 0; face < 6; face++) {
+        if (paths[face] == NULL)
+            continue;
+        video_clip *clip = &player->clips[face];
+        if (!open_video_clip(clip, paths[face])) {
+            close_videos(player);
+            return 0;
+        }
+        memory += video_frame_size(clip) * VIDEO_SLOTS;
+        printf("Video on face %d: %s, %ux%u, %u frames at %.2f fps\n", face, paths[face],
+            clip->header.width, clip->header.height, clip->header.frame_count, clip->rate);
+    }
+    printf("Video frames: %.1f MB\n", memory / 1e6);
+
+    if (pthread_create(&player->thread, NULL, video_thread, player)) {
+        perror("Error starting video thread");
+        close_videos(player);
+        return 0;
+    }
+    player->running = 1;
+    return 1;
+}
+
+// Shows the frames for cube time `time`, or the closest thing decoded
+// so far, and lets the prefetcher know. Nothing may be drawing
+void update_videos(video_player *player, double time)
+{
+    pthread_mutex_lock(&player->lock);
+    for (int face = 0; face < 6; face++) {
+        video_clip *clip = &player->clips[face];
+        if (clip->data == NULL) {
+            video_textures[face] = (video_texture){NULL, 0, 0};
+            continue;
+        }
+        long count = clip->header.frame_count;
+        long frame = (long)floor(time / 20 * clip->rate) % count;
+        if (frame < 0)
+            frame += count;
+        int moved = frame != clip->wanted;
+        clip->wanted = frame;
+        if (clip->slots[clip->shown].frame != frame) {
+            int found = 0;
+            for (int i = 0; i < VIDEO_SLOTS && !found; i++) {
+                if (clip->slots[i].frame == frame) {
+                    clip->shown = i;
+                    found = 1;
+                }
+            }
+            clip->late += !found && moved;
+        }
+        video_textures[face] = (video_texture){clip->slots[clip->shown].pixels,
+            clip->header.width, clip->header.height};
+    }
+    pthread_cond_signal(&player->wanted);
+    pthread_mutex_unlock(&player->lock);
+}
@@ -0,0 +1,73 @@
+import struct
+import sys
+
+# Packs raw BGRA frames read from stdin into a video for VIDEO_FACES
+# (see video.h):
+#   python video_to_binary_data.py <width> <height> <fps> <output> [--raw]
+# Frames are run length encoded unless --raw is given
+
+if len(sys.argv) < 5:
+    print("Usage: python video_to_binary_data.py <width> <height> <fps> <output> [--raw]")
+    sys.exit(1)
+
+width, height = int(sys.argv[1]), int(sys.argv[2])
+fps = float(sys.argv[3])
+output = sys.argv[4]
+raw = "--raw" in sys.argv[5:]
+frame_size = width * height * 4
+
+# Same encoding as record_rle_encode() in record.h
+def rle_encode(frame):
+    pixels = [frame[i:i+4] for i in range(0, len(frame), 4)]
+    count = len(pixels)
+    out = bytearray()
+    i = 0
+    while i < count:
+        run = 1
+        while i + run < count and run < 128 and pixels[i + run] == pixels[i]:
+            run += 1
+        if run > 1:
+            out.append(0x80 | (run - 1))
+            out += pixels[i]
+            i += run
+            continue
+        literals = 1
+        while i + literals < count and literals < 128:
+            n = i + literals
+            if n + 2 < count and pixels[n] == pixels[n + 1] == pixels[n + 2]:
+                break
+            literals += 1
+        out.append(literals - 1)
+        out += b"".join(pixels[i:i + literals])
+        i += literals
+    return bytes(out)
+
+frames = []
+while True:
+    frame = sys.stdin.buffer.read(frame_size)
+    if len(frame) < frame_size:
+        break
+    frames.append(frame if raw else rle_encode(frame))
+
+if not frames:
+    print("No frames read")
+    sys.exit(1)
+
+# Frame rate as a fraction, precise enough for 29.97 and such
+rate_denominator = 1000
+rate_numerator = round(fps * rate_denominator)
+header = struct.pack("<8sIIIIII", b"TTYCVID1", width, height, len(frames),
+                     1 if raw else 2, rate_numerator, rate_denominator)
+
+with open(output, "wb") as file:
+    file.write(header)
+    if not raw:
+        offset = len(header) + 8 * (len(frames) + 1)
+        for frame in frames:
+            file.write(struct.pack("<Q", offset))
+            offset += len(frame)
+        file.write(struct.pack("<Q", offset))
+    for frame in frames:
+        file.write(frame)
+
+print(f"{len(frames)} frames, {width}x{height} at {fps} fps")